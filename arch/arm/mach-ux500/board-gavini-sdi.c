@@ -372,8 +372,10 @@ static struct mmci_platform_data ssg_sdi2_data = {
 				MMC_CAP_MMC_HIGHSPEED|
 				MMC_CAP_ERASE |
 				MMC_CAP_1_8V_DDR |
-				MMC_CAP_UHS_DDR50,
-	.capabilities2	= MMC_CAP2_NO_SLEEP_CMD,
+				MMC_CAP_UHS_DDR50 |
+				MMC_CAP_CMD23,
+	.capabilities2	= MMC_CAP2_NO_SLEEP_CMD |
+				MMC_CAP2_PACKED_WR,
 //	.pm_flags	= MMC_PM_KEEP_POWER,
 	.gpio_cd	= -1,
 	.gpio_wp	= -1,
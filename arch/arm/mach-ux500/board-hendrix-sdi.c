@@ -388,8 +388,10 @@ static struct mmci_platform_data ssg_sdi2_data = {
 	.capabilities	= MMC_CAP_4_BIT_DATA |
 				MMC_CAP_8_BIT_DATA |
 				MMC_CAP_MMC_HIGHSPEED|
-				MMC_CAP_ERASE,
-	.capabilities2	= MMC_CAP2_NO_SLEEP_CMD,
+				MMC_CAP_ERASE |
+				MMC_CAP_CMD23,
+	.capabilities2	= MMC_CAP2_NO_SLEEP_CMD |
+				MMC_CAP2_PACKED_WR,
 //	.pm_flags	= MMC_PM_KEEP_POWER,
 	.gpio_cd	= -1,
 	.gpio_wp	= -1,
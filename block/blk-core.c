@@ -311,6 +311,8 @@ void blk_sync_queue(struct request_queue *q)
 {
 	del_timer_sync(&q->timeout);
 	cancel_delayed_work_sync(&q->delay_work);
+	if (q->stage)
+		blk_stage_sync(q);
 }
 EXPORT_SYMBOL(blk_sync_queue);
 
@@ -452,6 +454,10 @@ void blk_cleanup_queue(struct request_queue *q)
 	spin_unlock_irq(lock);
 	mutex_unlock(&q->sysfs_lock);
 
+	/* fail the bios still staged, @q is DEAD so no request is allocated */
+	if (q->stage)
+		blk_stage_sync(q);
+
 	/*
 	 * Drain all requests queued before DEAD marking.  The caller might
 	 * be trying to tear down @q before its elevator is initialized, in
@@ -1338,11 +1344,286 @@ void init_request_from_bio(struct request *req, struct bio *bio)
 	blk_rq_bio_prep(req->q, req, bio);
 }
 
+/*
+ * Try to merge @bio into a request already queued on the elevator.
+ * Must be called with the queue lock held.
+ */
+static bool blk_queue_bio_merge(struct request_queue *q, struct bio *bio)
+{
+	struct request *req;
+	int el_ret;
+
+	el_ret = elv_merge(q, &req, bio);
+	if (el_ret == ELEVATOR_BACK_MERGE) {
+		if (bio_attempt_back_merge(q, req, bio)) {
+			elv_bio_merged(q, req, bio);
+			if (!attempt_back_merge(q, req))
+				elv_merged_request(q, req, el_ret);
+			return true;
+		}
+	} else if (el_ret == ELEVATOR_FRONT_MERGE) {
+		if (bio_attempt_front_merge(q, req, bio)) {
+			elv_bio_merged(q, req, bio);
+			if (!attempt_front_merge(q, req))
+				elv_merged_request(q, req, el_ret);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Software staging queues
+ *
+ * With several tasks doing I/O to the same device, every bio takes the
+ * queue lock at least twice, to merge or allocate a request and to add
+ * it. A driver may instead call blk_queue_init_staging(). Bios are then
+ * put on a per-cpu list under a per-cpu lock and a single context at a
+ * time, the dispatcher, moves all of them to the request queue with one
+ * queue lock round trip per batch. A task that submits outside of a plug
+ * becomes the dispatcher unless another one is busy, plugged bios are
+ * dispatched from kblockd when the plug is flushed.
+ *
+ * Since requests get allocated from the dispatcher's context, staging is
+ * only used with elevators that do not track the submitting io_context,
+ * i.e. noop and deadline, see blk_queue_update_staging(). Flush and FUA
+ * bios always take the direct path.
+ */
+#define BLK_STAGE_DISPATCHING	0
+/* Rounds a submitter dispatches before leaving the rest to kblockd */
+#define BLK_STAGE_MAX_ROUNDS	4
+
+struct blk_stage_plug_cb {
+	struct blk_plug_cb	cb;
+	struct request_queue	*q;
+};
+
+static bool blk_stage_pending(struct request_queue *q)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (!bio_list_empty(&per_cpu_ptr(q->stage, cpu)->bios))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Turn a staged bio into a request. Called with the queue lock held and
+ * returns with it held, but may drop it to wait for a free request.
+ */
+static void blk_stage_dispatch_bio(struct request_queue *q, struct bio *bio,
+				   int cpu)
+{
+	struct request *req;
+	int rw_flags;
+
+	if (blk_queue_bio_merge(q, bio))
+		return;
+
+	rw_flags = bio_data_dir(bio);
+	if (bio->bi_rw & REQ_SYNC)
+		rw_flags |= REQ_SYNC;
+
+	req = get_request(q, rw_flags, bio, GFP_NOIO);
+	if (!req) {
+		/* the requests of this batch must be able to complete */
+		__blk_run_queue(q);
+		req = get_request_wait(q, rw_flags, bio);
+		if (unlikely(!req)) {
+			bio_endio(bio, -ENODEV);	/* @q is dead */
+			return;
+		}
+	}
+
+	init_request_from_bio(req, bio);
+	if (test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags))
+		req->cpu = cpu;
+
+	spin_lock_irq(q->queue_lock);
+	add_acct_request(q, req, ELEVATOR_INSERT_SORT);
+}
+
+/**
+ * blk_stage_drain - move the staged bios to the request queue
+ * @q: the request queue
+ *
+ * Does nothing if another context is dispatching already, that one
+ * picks up whatever was staged before it finishes.
+ */
+void blk_stage_drain(struct request_queue *q)
+{
+	int rounds = 0;
+	int cpu;
+
+	if (test_and_set_bit(BLK_STAGE_DISPATCHING, &q->stage_state))
+		return;
+again:
+	spin_lock_irq(q->queue_lock);
+	for_each_possible_cpu(cpu) {
+		struct blk_stage_queue *sq = per_cpu_ptr(q->stage, cpu);
+		struct bio_list bios;
+		struct bio *bio;
+
+		spin_lock(&sq->lock);
+		bios = sq->bios;
+		bio_list_init(&sq->bios);
+		spin_unlock(&sq->lock);
+
+		while ((bio = bio_list_pop(&bios))) {
+			blk_stage_dispatch_bio(q, bio, cpu);
+			q->stage_bios++;
+		}
+	}
+	q->stage_batches++;
+	__blk_run_queue(q);
+	spin_unlock_irq(q->queue_lock);
+
+	clear_bit(BLK_STAGE_DISPATCHING, &q->stage_state);
+	smp_mb__after_clear_bit();
+	if (!blk_stage_pending(q) ||
+	    test_and_set_bit(BLK_STAGE_DISPATCHING, &q->stage_state))
+		return;
+
+	if (++rounds < BLK_STAGE_MAX_ROUNDS)
+		goto again;
+
+	clear_bit(BLK_STAGE_DISPATCHING, &q->stage_state);
+	kblockd_schedule_work(q, &q->stage_work);
+}
+
+/**
+ * blk_stage_sync - wait until nothing is staged or being dispatched
+ * @q: the request queue
+ *
+ * Unlike blk_stage_drain() this also waits for a dispatcher running in
+ * another context, including stage_work, instead of leaving the bios to
+ * it. Bios staged meanwhile are dispatched as well.
+ */
+void blk_stage_sync(struct request_queue *q)
+{
+	while (true) {
+		flush_work(&q->stage_work);
+		blk_stage_drain(q);
+
+		if (!blk_stage_pending(q) && !work_pending(&q->stage_work) &&
+		    !test_bit(BLK_STAGE_DISPATCHING, &q->stage_state))
+			break;
+		msleep(10);
+	}
+}
+
+static void blk_stage_work_fn(struct work_struct *work)
+{
+	struct request_queue *q = container_of(work, struct request_queue,
+					       stage_work);
+
+	blk_stage_drain(q);
+}
+
+static void blk_stage_unplug(struct blk_plug_cb *cb)
+{
+	struct blk_stage_plug_cb *scb;
+
+	scb = container_of(cb, struct blk_stage_plug_cb, cb);
+	kblockd_schedule_work(scb->q, &scb->q->stage_work);
+	kfree(scb);
+}
+
+/*
+ * Make sure the plug of the current task dispatches @q when it is
+ * flushed. Returns false if the caller has to dispatch by itself.
+ */
+static bool blk_stage_plug(struct request_queue *q)
+{
+	struct blk_plug *plug = current->plug;
+	struct blk_stage_plug_cb *scb;
+
+	if (!plug)
+		return false;
+
+	list_for_each_entry(scb, &plug->cb_list, cb.list) {
+		if (scb->cb.callback == blk_stage_unplug && scb->q == q)
+			return true;
+	}
+
+	scb = kmalloc(sizeof(*scb), GFP_ATOMIC);
+	if (!scb)
+		return false;
+
+	scb->cb.callback = blk_stage_unplug;
+	scb->q = q;
+	list_add(&scb->cb.list, &plug->cb_list);
+	return true;
+}
+
+static void blk_stage_bio(struct request_queue *q, struct bio *bio)
+{
+	struct blk_stage_queue *sq;
+	unsigned long flags;
+
+	sq = get_cpu_ptr(q->stage);
+	spin_lock_irqsave(&sq->lock, flags);
+	bio_list_add(&sq->bios, bio);
+	spin_unlock_irqrestore(&sq->lock, flags);
+	put_cpu_ptr(q->stage);
+
+	if (!blk_stage_plug(q))
+		blk_stage_drain(q);
+}
+
+/*
+ * Staging is in use if the driver asked for it and the elevator keeps no
+ * per io_context state. Must be called with the queue lock held.
+ */
+void blk_queue_update_staging(struct request_queue *q)
+{
+	if (q->stage && q->elevator && !q->elevator->type->icq_cache)
+		queue_flag_set(QUEUE_FLAG_STAGED, q);
+	else
+		queue_flag_clear(QUEUE_FLAG_STAGED, q);
+}
+
+/**
+ * blk_queue_init_staging - put per-cpu staging queues in front of @q
+ * @q: the request queue
+ *
+ * Description:
+ *    For request based drivers with a single dispatch context, like a
+ *    queue thread, that see parallel I/O from many tasks. See the comment
+ *    above for how and when the staging queues are used.
+ **/
+int blk_queue_init_staging(struct request_queue *q)
+{
+	struct blk_stage_queue __percpu *stage;
+	int cpu;
+
+	stage = alloc_percpu(struct blk_stage_queue);
+	if (!stage)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_stage_queue *sq = per_cpu_ptr(stage, cpu);
+
+		spin_lock_init(&sq->lock);
+		bio_list_init(&sq->bios);
+	}
+	INIT_WORK(&q->stage_work, blk_stage_work_fn);
+
+	spin_lock_irq(q->queue_lock);
+	q->stage = stage;
+	blk_queue_update_staging(q);
+	spin_unlock_irq(q->queue_lock);
+	return 0;
+}
+EXPORT_SYMBOL(blk_queue_init_staging);
+
 void blk_queue_bio(struct request_queue *q, struct bio *bio)
 {
 	const bool sync = !!(bio->bi_rw & REQ_SYNC);
 	struct blk_plug *plug;
-	int el_ret, rw_flags, where = ELEVATOR_INSERT_SORT;
+	int rw_flags, where = ELEVATOR_INSERT_SORT;
 	struct request *req;
 	unsigned int request_count = 0;
 
@@ -1353,6 +1634,11 @@ void blk_queue_bio(struct request_queue *q, struct bio *bio)
 	 */
 	blk_queue_bounce(q, &bio);
 
+	if (blk_queue_staged(q) && !(bio->bi_rw & (REQ_FLUSH | REQ_FUA))) {
+		blk_stage_bio(q, bio);
+		return;
+	}
+
 	if (bio->bi_rw & (REQ_FLUSH | REQ_FUA)) {
 		spin_lock_irq(q->queue_lock);
 		where = ELEVATOR_INSERT_FLUSH;
@@ -1368,22 +1654,8 @@ void blk_queue_bio(struct request_queue *q, struct bio *bio)
 
 	spin_lock_irq(q->queue_lock);
 
-	el_ret = elv_merge(q, &req, bio);
-	if (el_ret == ELEVATOR_BACK_MERGE) {
-		if (bio_attempt_back_merge(q, req, bio)) {
-			elv_bio_merged(q, req, bio);
-			if (!attempt_back_merge(q, req))
-				elv_merged_request(q, req, el_ret);
-			goto out_unlock;
-		}
-	} else if (el_ret == ELEVATOR_FRONT_MERGE) {
-		if (bio_attempt_front_merge(q, req, bio)) {
-			elv_bio_merged(q, req, bio);
-			if (!attempt_front_merge(q, req))
-				elv_merged_request(q, req, el_ret);
-			goto out_unlock;
-		}
-	}
+	if (blk_queue_bio_merge(q, bio))
+		goto out_unlock;
 
 get_rq:
 	/*
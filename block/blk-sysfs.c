@@ -275,6 +275,12 @@ queue_rq_affinity_store(struct request_queue *q, const char *page, size_t count)
 	return ret;
 }
 
+static ssize_t queue_staging_show(struct request_queue *q, char *page)
+{
+	return sprintf(page, "%d %lu %lu\n", blk_queue_staged(q) ? 1 : 0,
+		       q->stage_bios, q->stage_batches);
+}
+
 static struct queue_sysfs_entry queue_requests_entry = {
 	.attr = {.name = "nr_requests", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_requests_show,
@@ -389,6 +395,11 @@ static struct queue_sysfs_entry queue_random_entry = {
 	.store = queue_store_random,
 };
 
+static struct queue_sysfs_entry queue_staging_entry = {
+	.attr = {.name = "staging", .mode = S_IRUGO },
+	.show = queue_staging_show,
+};
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
@@ -411,6 +422,7 @@ static struct attribute *default_attrs[] = {
 	&queue_rq_affinity_entry.attr,
 	&queue_iostats_entry.attr,
 	&queue_random_entry.attr,
+	&queue_staging_entry.attr,
 	NULL,
 };
 
@@ -490,6 +502,8 @@ static void blk_release_queue(struct kobject *kobj)
 
 	blk_throtl_exit(q);
 
+	free_percpu(q->stage);
+
 	if (rl->rq_pool)
 		mempool_destroy(rl->rq_pool);
 
@@ -18,6 +18,19 @@ static inline void __blk_get_queue(struct request_queue *q)
 	kobject_get(&q->kobj);
 }
 
+/*
+ * Per-cpu software queue in front of a request_queue, bios are staged here
+ * without taking the queue lock and turned into requests in batches.
+ */
+struct blk_stage_queue {
+	spinlock_t		lock;
+	struct bio_list		bios;
+};
+
+void blk_queue_update_staging(struct request_queue *q);
+void blk_stage_drain(struct request_queue *q);
+void blk_stage_sync(struct request_queue *q);
+
 void init_request_from_bio(struct request *req, struct bio *bio);
 void blk_rq_bio_prep(struct request_queue *q, struct request *rq,
 			struct bio *bio);
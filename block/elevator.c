@@ -941,6 +941,7 @@ static int elevator_switch(struct request_queue *q, struct elevator_type *new_e)
 	ioc_clear_queue(q);
 	old_elevator = q->elevator;
 	q->elevator = e;
+	blk_queue_update_staging(q);
 	spin_unlock_irq(q->queue_lock);
 
 	elevator_exit(old_elevator);
@@ -11,6 +11,9 @@
 #include <linux/rbtree.h>
 #include <linux/ioprio.h>
 #include <linux/blktrace_api.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 #include "blk.h"
 
 #define VIOS_SCALE_SHIFT 10
@@ -23,6 +26,27 @@
 
 #define VIOS_PRIO_SCALE (5)
 
+/*
+ * Latency targets in ms, 0 disables the target of a class. A request
+ * that waited longer than its target is dispatched ahead of the service
+ * tree order, see fiops_select_ioc().
+ */
+#define FIOPS_READ_TARGET (50)
+#define FIOPS_SYNC_WRITE_TARGET (100)
+#define FIOPS_ASYNC_TARGET (500)
+
+/*
+ * A best effort ioc with an ioprio of at most fg_ioprio is taken to be
+ * foreground, as Android moves background threads to nice 10 and so to
+ * ioprio 6. When it becomes busy it is queued fg_boost requests worth of
+ * vios ahead of the other iocs.
+ */
+#define FIOPS_FG_IOPRIO (IOPRIO_NORM)
+#define FIOPS_FG_BOOST (4)
+
+/* Completion latency buckets: <1ms, then powers of two up to >=1024ms */
+#define FIOPS_LAT_BUCKETS (12)
+
 struct fiops_rb_root {
 	struct rb_root rb;
 	struct rb_node *left;
@@ -39,10 +63,31 @@ enum wl_prio_t {
 	FIOPS_PRIO_NR,
 };
 
+enum fiops_rq_class {
+	FIOPS_CLASS_READ = 0,
+	FIOPS_CLASS_SYNC_WRITE,
+	FIOPS_CLASS_ASYNC,
+	FIOPS_CLASS_NR,
+};
+
+static const char * const fiops_class_names[FIOPS_CLASS_NR] = {
+	[FIOPS_CLASS_READ] = "read",
+	[FIOPS_CLASS_SYNC_WRITE] = "sync_write",
+	[FIOPS_CLASS_ASYNC] = "async",
+};
+
+struct fiops_stats {
+	u32 latency[FIOPS_CLASS_NR][FIOPS_LAT_BUCKETS];
+	u32 expired[FIOPS_CLASS_NR];
+	u32 boosted;
+};
+
 struct fiops_data {
 	struct request_queue *queue;
 
 	struct fiops_rb_root service_tree[FIOPS_PRIO_NR];
+	/* iocs whose oldest request has a latency target, by deadline */
+	struct rb_root deadline_tree;
 
 	unsigned int busy_queues;
 	unsigned int in_flight[2];
@@ -53,6 +98,13 @@ struct fiops_data {
 	unsigned int write_scale;
 	unsigned int sync_scale;
 	unsigned int async_scale;
+
+	unsigned int target_ms[FIOPS_CLASS_NR];
+	unsigned int fg_ioprio;
+	unsigned int fg_boost;
+
+	struct fiops_stats stats;
+	struct dentry *debugfs;
 };
 
 struct fiops_ioc {
@@ -64,6 +116,9 @@ struct fiops_ioc {
 	u64 vios; /* key in service_tree */
 	struct fiops_rb_root *service_tree;
 
+	struct rb_node deadline_node;
+	unsigned long deadline; /* key in deadline_tree, in us */
+
 	unsigned int in_flight;
 
 	struct rb_root sort_list;
@@ -76,6 +131,10 @@ struct fiops_ioc {
 
 #define ioc_service_tree(ioc) (&((ioc)->fiopsd->service_tree[(ioc)->wl_type]))
 #define RQ_CIC(rq)		icq_to_cic((rq)->elv.icq)
+/* insertion time in us, wraps */
+#define RQ_TIME(rq)		((unsigned long)(rq)->elv.priv[0])
+
+static struct dentry *fiops_debugfs_root;
 
 enum ioc_state_flags {
 	FIOPS_IOC_FLAG_on_rr = 0,	/* on round-robin busy list */
@@ -179,6 +238,30 @@ static void fiops_update_min_vios(struct fiops_rb_root *service_tree)
 	service_tree->min_vios = max_vios(service_tree->min_vios, ioc->vios);
 }
 
+static inline bool fiops_ioc_foreground(struct fiops_data *fiopsd,
+	struct fiops_ioc *ioc)
+{
+	return ioc->wl_type == BE_WORKLOAD && ioc->ioprio <= fiopsd->fg_ioprio;
+}
+
+/*
+ * The vios an ioc that just became busy starts at. Foreground iocs start
+ * ahead of the others so that an app launch is not queued behind a
+ * background writer that has been busy for a while.
+ */
+static u64 fiops_start_vios(struct fiops_data *fiopsd, struct fiops_ioc *ioc,
+	struct fiops_rb_root *service_tree)
+{
+	u64 boost = (u64)fiopsd->fg_boost * VIOS_SCALE;
+
+	if (!boost || !fiops_ioc_foreground(fiopsd, ioc))
+		return service_tree->min_vios;
+
+	if (service_tree->min_vios < boost)
+		return 0;
+	return service_tree->min_vios - boost;
+}
+
 /*
  * The fiopsd->service_trees holds all pending fiops_ioc's that have
  * requests waiting to be processed. It is sorted in the order that
@@ -197,8 +280,15 @@ static void fiops_service_tree_add(struct fiops_data *fiopsd,
 	if (RB_EMPTY_NODE(&ioc->rb_node)) {
 		if (ioc->in_flight > 0)
 			vios = ioc->vios;
-		else
-			vios = max_vios(service_tree->min_vios, ioc->vios);
+		else {
+			vios = max_vios(fiops_start_vios(fiopsd, ioc,
+					service_tree), ioc->vios);
+			/* a boost only counts if it moved the ioc ahead */
+			if ((s64)(vios - service_tree->min_vios) < 0) {
+				fiopsd->stats.boosted++;
+				fiops_log_ioc(fiopsd, ioc, "foreground boost");
+			}
+		}
 	} else {
 		vios = ioc->vios;
 		/* ioc->service_tree might not equal to service_tree */
@@ -314,10 +404,70 @@ static void fiops_reposition_rq_rb(struct fiops_ioc *ioc, struct request *rq)
 	fiops_add_rq_rb(rq);
 }
 
+static inline unsigned long fiops_now_us(void)
+{
+	return (unsigned long)ktime_to_us(ktime_get());
+}
+
+static enum fiops_rq_class fiops_rq_class(struct request *rq)
+{
+	if (!rq_is_sync(rq))
+		return FIOPS_CLASS_ASYNC;
+	if (rq_data_dir(rq) == WRITE)
+		return FIOPS_CLASS_SYNC_WRITE;
+	return FIOPS_CLASS_READ;
+}
+
+/*
+ * Requests of an ioc are dispatched in fifo order, so the deadline of an
+ * ioc is the one of its oldest request. Idle class iocs have none.
+ */
+static void fiops_update_deadline(struct fiops_data *fiopsd,
+	struct fiops_ioc *ioc)
+{
+	struct rb_node **p, *parent;
+	struct fiops_ioc *__ioc;
+	struct request *rq;
+	unsigned int target;
+
+	if (!RB_EMPTY_NODE(&ioc->deadline_node))
+		rb_erase_init(&ioc->deadline_node, &fiopsd->deadline_tree);
+
+	if (list_empty(&ioc->fifo) || ioc->wl_type == IDLE_WORKLOAD)
+		return;
+
+	rq = rq_entry_fifo(ioc->fifo.next);
+	target = fiopsd->target_ms[fiops_rq_class(rq)];
+	if (!target)
+		return;
+	ioc->deadline = RQ_TIME(rq) + target * USEC_PER_MSEC;
+
+	parent = NULL;
+	p = &fiopsd->deadline_tree.rb_node;
+	while (*p) {
+		parent = *p;
+		__ioc = rb_entry(parent, struct fiops_ioc, deadline_node);
+
+		if ((long)(ioc->deadline - __ioc->deadline) < 0)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	rb_link_node(&ioc->deadline_node, parent, p);
+	rb_insert_color(&ioc->deadline_node, &fiopsd->deadline_tree);
+}
+
 static void fiops_remove_request(struct request *rq)
 {
+	struct fiops_ioc *ioc = RQ_CIC(rq);
+	bool first = ioc->fifo.next == &rq->queuelist;
+
 	list_del_init(&rq->queuelist);
 	fiops_del_rq_rb(rq);
+
+	if (first)
+		fiops_update_deadline(ioc->fiopsd, ioc);
 }
 
 static u64 fiops_scaled_vios(struct fiops_data *fiopsd,
@@ -375,6 +525,30 @@ static int fiops_forced_dispatch(struct fiops_data *fiopsd)
 	return dispatched;
 }
 
+/*
+ * Return the ioc whose oldest request is over its latency target, if
+ * any. It is served before the service tree order.
+ */
+static struct fiops_ioc *fiops_expired_ioc(struct fiops_data *fiopsd)
+{
+	struct rb_node *node = rb_first(&fiopsd->deadline_tree);
+	struct fiops_ioc *ioc;
+	struct request *rq;
+
+	if (!node)
+		return NULL;
+
+	ioc = rb_entry(node, struct fiops_ioc, deadline_node);
+	if ((long)(fiops_now_us() - ioc->deadline) < 0)
+		return NULL;
+
+	rq = rq_entry_fifo(ioc->fifo.next);
+	fiopsd->stats.expired[fiops_rq_class(rq)]++;
+	fiops_log_ioc(fiopsd, ioc, "expired, waited %luus",
+		fiops_now_us() - RQ_TIME(rq));
+	return ioc;
+}
+
 static struct fiops_ioc *fiops_select_ioc(struct fiops_data *fiopsd)
 {
 	struct fiops_ioc *ioc;
@@ -382,6 +556,10 @@ static struct fiops_ioc *fiops_select_ioc(struct fiops_data *fiopsd)
 	int i;
 	struct request *rq;
 
+	ioc = fiops_expired_ioc(fiopsd);
+	if (ioc)
+		return ioc;
+
 	for (i = RT_WORKLOAD; i >= IDLE_WORKLOAD; i--) {
 		if (!RB_EMPTY_ROOT(&fiopsd->service_tree[i].rb)) {
 			service_tree = &fiopsd->service_tree[i];
@@ -489,7 +667,10 @@ static void fiops_insert_request(struct request_queue *q, struct request *rq)
 
 	fiops_init_prio_data(ioc);
 
+	rq->elv.priv[0] = (void *)fiops_now_us();
 	list_add_tail(&rq->queuelist, &ioc->fifo);
+	if (ioc->fifo.next == &rq->queuelist)
+		fiops_update_deadline(ioc->fiopsd, ioc);
 
 	fiops_add_rq_rb(rq);
 }
@@ -508,6 +689,10 @@ static void fiops_completed_request(struct request_queue *q, struct request *rq)
 {
 	struct fiops_data *fiopsd = q->elevator->elevator_data;
 	struct fiops_ioc *ioc = RQ_CIC(rq);
+	unsigned long ms = (fiops_now_us() - RQ_TIME(rq)) / USEC_PER_MSEC;
+	int bucket = min_t(int, fls_long(ms), FIOPS_LAT_BUCKETS - 1);
+
+	fiopsd->stats.latency[fiops_rq_class(rq)][bucket]++;
 
 	fiopsd->in_flight[rq_is_sync(rq)]--;
 	ioc->in_flight--;
@@ -599,6 +784,7 @@ static void fiops_exit_queue(struct elevator_queue *e)
 	struct fiops_data *fiopsd = e->elevator_data;
 
 	cancel_work_sync(&fiopsd->unplug_work);
+	debugfs_remove(fiopsd->debugfs);
 
 	kfree(fiopsd);
 }
@@ -614,9 +800,45 @@ static void fiops_kick_queue(struct work_struct *work)
 	spin_unlock_irq(q->queue_lock);
 }
 
+static int fiops_stats_show(struct seq_file *m, void *unused)
+{
+	struct fiops_data *fiopsd = m->private;
+	struct fiops_stats *stats = &fiopsd->stats;
+	int i, j;
+
+	seq_printf(m, "%-10s %8s", "class", "expired");
+	seq_printf(m, " %7s", "<1");
+	for (j = 1; j < FIOPS_LAT_BUCKETS - 1; j++)
+		seq_printf(m, " %6s%d", "<", 1 << j);
+	seq_printf(m, " %6s%d ms\n", ">=", 1 << (FIOPS_LAT_BUCKETS - 2));
+
+	for (i = 0; i < FIOPS_CLASS_NR; i++) {
+		seq_printf(m, "%-10s %8u", fiops_class_names[i],
+			   stats->expired[i]);
+		for (j = 0; j < FIOPS_LAT_BUCKETS; j++)
+			seq_printf(m, " %7u", stats->latency[i][j]);
+		seq_putc(m, '\n');
+	}
+	seq_printf(m, "foreground boosts %u\n", stats->boosted);
+	return 0;
+}
+
+static int fiops_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, fiops_stats_show, inode->i_private);
+}
+
+static const struct file_operations fiops_stats_fops = {
+	.open		= fiops_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static void *fiops_init_queue(struct request_queue *q)
 {
 	struct fiops_data *fiopsd;
+	char name[16];
 	int i;
 
 	fiopsd = kzalloc_node(sizeof(*fiopsd), GFP_KERNEL, q->node);
@@ -627,6 +849,7 @@ static void *fiops_init_queue(struct request_queue *q)
 
 	for (i = IDLE_WORKLOAD; i <= RT_WORKLOAD; i++)
 		fiopsd->service_tree[i] = FIOPS_RB_ROOT;
+	fiopsd->deadline_tree = RB_ROOT;
 
 	INIT_WORK(&fiopsd->unplug_work, fiops_kick_queue);
 
@@ -635,6 +858,18 @@ static void *fiops_init_queue(struct request_queue *q)
 	fiopsd->sync_scale = VIOS_SYNC_SCALE;
 	fiopsd->async_scale = VIOS_ASYNC_SCALE;
 
+	fiopsd->target_ms[FIOPS_CLASS_READ] = FIOPS_READ_TARGET;
+	fiopsd->target_ms[FIOPS_CLASS_SYNC_WRITE] = FIOPS_SYNC_WRITE_TARGET;
+	fiopsd->target_ms[FIOPS_CLASS_ASYNC] = FIOPS_ASYNC_TARGET;
+	fiopsd->fg_ioprio = FIOPS_FG_IOPRIO;
+	fiopsd->fg_boost = FIOPS_FG_BOOST;
+
+	if (fiops_debugfs_root) {
+		snprintf(name, sizeof(name), "queue%d", q->id);
+		fiopsd->debugfs = debugfs_create_file(name, S_IRUGO,
+				fiops_debugfs_root, fiopsd, &fiops_stats_fops);
+	}
+
 	return fiopsd;
 }
 
@@ -644,6 +879,7 @@ static void fiops_init_icq(struct io_cq *icq)
 	struct fiops_ioc *ioc = icq_to_cic(icq);
 
 	RB_CLEAR_NODE(&ioc->rb_node);
+	RB_CLEAR_NODE(&ioc->deadline_node);
 	INIT_LIST_HEAD(&ioc->fifo);
 	ioc->sort_list = RB_ROOT;
 
@@ -681,6 +917,14 @@ SHOW_FUNCTION(fiops_read_scale_show, fiopsd->read_scale);
 SHOW_FUNCTION(fiops_write_scale_show, fiopsd->write_scale);
 SHOW_FUNCTION(fiops_sync_scale_show, fiopsd->sync_scale);
 SHOW_FUNCTION(fiops_async_scale_show, fiopsd->async_scale);
+SHOW_FUNCTION(fiops_read_target_ms_show,
+	fiopsd->target_ms[FIOPS_CLASS_READ]);
+SHOW_FUNCTION(fiops_sync_write_target_ms_show,
+	fiopsd->target_ms[FIOPS_CLASS_SYNC_WRITE]);
+SHOW_FUNCTION(fiops_async_target_ms_show,
+	fiopsd->target_ms[FIOPS_CLASS_ASYNC]);
+SHOW_FUNCTION(fiops_fg_ioprio_show, fiopsd->fg_ioprio);
+SHOW_FUNCTION(fiops_fg_boost_show, fiopsd->fg_boost);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX)				\
@@ -700,6 +944,14 @@ STORE_FUNCTION(fiops_read_scale_store, &fiopsd->read_scale, 1, 100);
 STORE_FUNCTION(fiops_write_scale_store, &fiopsd->write_scale, 1, 100);
 STORE_FUNCTION(fiops_sync_scale_store, &fiopsd->sync_scale, 1, 100);
 STORE_FUNCTION(fiops_async_scale_store, &fiopsd->async_scale, 1, 100);
+STORE_FUNCTION(fiops_read_target_ms_store,
+	&fiopsd->target_ms[FIOPS_CLASS_READ], 0, 10000);
+STORE_FUNCTION(fiops_sync_write_target_ms_store,
+	&fiopsd->target_ms[FIOPS_CLASS_SYNC_WRITE], 0, 10000);
+STORE_FUNCTION(fiops_async_target_ms_store,
+	&fiopsd->target_ms[FIOPS_CLASS_ASYNC], 0, 10000);
+STORE_FUNCTION(fiops_fg_ioprio_store, &fiopsd->fg_ioprio, 0, IOPRIO_BE_NR - 1);
+STORE_FUNCTION(fiops_fg_boost_store, &fiopsd->fg_boost, 0, 100);
 #undef STORE_FUNCTION
 
 #define FIOPS_ATTR(name) \
@@ -710,6 +962,11 @@ static struct elv_fs_entry fiops_attrs[] = {
 	FIOPS_ATTR(write_scale),
 	FIOPS_ATTR(sync_scale),
 	FIOPS_ATTR(async_scale),
+	FIOPS_ATTR(read_target_ms),
+	FIOPS_ATTR(sync_write_target_ms),
+	FIOPS_ATTR(async_target_ms),
+	FIOPS_ATTR(fg_ioprio),
+	FIOPS_ATTR(fg_boost),
 	__ATTR_NULL
 };
 
@@ -737,12 +994,16 @@ static struct elevator_type iosched_fiops = {
 
 static int __init fiops_init(void)
 {
+	fiops_debugfs_root = debugfs_create_dir("fiops", NULL);
+	if (IS_ERR(fiops_debugfs_root))
+		fiops_debugfs_root = NULL;
 	return elv_register(&iosched_fiops);
 }
 
 static void __exit fiops_exit(void)
 {
 	elv_unregister(&iosched_fiops);
+	debugfs_remove(fiops_debugfs_root);
 }
 
 module_init(fiops_init);
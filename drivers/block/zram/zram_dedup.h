@@ -0,0 +1,52 @@
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+struct zram;
+struct zram_meta;
+struct zram_entry;
+struct zcomp_strm;
+
+#ifdef CONFIG_ZRAM_DEDUP
+u64 zram_dedup_dup_size(struct zram *zram);
+u64 zram_dedup_meta_size(struct zram *zram);
+
+u32 zram_dedup_checksum(unsigned char *mem);
+void zram_dedup_insert(struct zram *zram, struct zram_entry *new,
+				u32 checksum);
+struct zram_entry *zram_dedup_find(struct zram *zram, struct zcomp_strm *zstrm,
+				unsigned char *mem, u32 checksum);
+
+void zram_dedup_init_entry(struct zram *zram, struct zram_entry *entry,
+				unsigned long handle, unsigned int len);
+bool zram_dedup_put_entry(struct zram *zram, struct zram_entry *entry);
+bool zram_dedup_shared(struct zram *zram, struct zram_entry *entry);
+
+int zram_dedup_init(struct zram_meta *meta, size_t num_pages);
+void zram_dedup_fini(struct zram_meta *meta);
+#else
+
+static inline u64 zram_dedup_dup_size(struct zram *zram) { return 0; }
+static inline u64 zram_dedup_meta_size(struct zram *zram) { return 0; }
+
+static inline u32 zram_dedup_checksum(unsigned char *mem) { return 0; }
+static inline void zram_dedup_insert(struct zram *zram, struct zram_entry *new,
+				u32 checksum) { }
+static inline struct zram_entry *zram_dedup_find(struct zram *zram,
+				struct zcomp_strm *zstrm, unsigned char *mem,
+				u32 checksum) { return NULL; }
+
+static inline void zram_dedup_init_entry(struct zram *zram,
+		struct zram_entry *entry, unsigned long handle,
+		unsigned int len) { }
+static inline bool zram_dedup_put_entry(struct zram *zram,
+		struct zram_entry *entry) { return true; }
+static inline bool zram_dedup_shared(struct zram *zram,
+		struct zram_entry *entry) { return false; }
+
+static inline int zram_dedup_init(struct zram_meta *meta,
+		size_t num_pages) { return 0; }
+static inline void zram_dedup_fini(struct zram_meta *meta) { }
+
+#endif
+
+#endif /* _ZRAM_DEDUP_H_ */
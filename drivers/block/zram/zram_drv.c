@@ -32,6 +32,7 @@
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 #include <linux/ratelimit.h>
+#include <linux/debugfs.h>
 
 #include <linux/err.h>
 
@@ -67,6 +68,10 @@ static const char *default_compressor = "lz4";
  */
 #define ALLOC_ERROR_LOG_RATE_MS 1000
 
+/* Allocation flags for compressed objects, the latter must not sleep */
+#define ZRAM_GFP		(GFP_NOIO | __GFP_HIGHMEM | __GFP_NOWARN)
+#define ZRAM_GFP_ATOMIC		(GFP_NOWAIT | __GFP_HIGHMEM | __GFP_NOWARN)
+
 /* Module params (documentation at end) */
 extern unsigned int zram_num_devices;
 
@@ -122,6 +127,52 @@ static ssize_t compact_store(struct device *dev,
 	return len;
 }
 
+static ssize_t compact_threshold_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", zram->compact_threshold);
+}
+
+static ssize_t compact_threshold_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	unsigned int val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (kstrtouint(buf, 10, &val) || val > 100)
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	zram->compact_threshold = val;
+	if (init_done(zram))
+		zs_set_compact_threshold(zram->meta->mem_pool, val);
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t compact_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zs_pool_stats pool_stats;
+	ssize_t ret;
+
+	memset(&pool_stats, 0, sizeof(pool_stats));
+
+	down_read(&zram->init_lock);
+	if (init_done(zram))
+		zs_pool_stats(zram->meta->mem_pool, &pool_stats);
+	ret = scnprintf(buf, PAGE_SIZE, "%8lu %8lu\n",
+			pool_stats.pages_compacted,
+			pool_stats.auto_compactions);
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+
 static ssize_t disksize_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -281,6 +332,39 @@ out:
 	return ret;
 }
 
+static ssize_t percpu_streams_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->percpu_streams;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", (int)val);
+}
+
+static ssize_t percpu_streams_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (kstrtoint(buf, 10, &val) || (val != 0 && val != 1))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change stream mode for initialized device\n");
+		return -EBUSY;
+	}
+	zram->percpu_streams = val;
+	up_write(&zram->init_lock);
+	return len;
+}
+
 static ssize_t comp_algorithm_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -309,6 +393,73 @@ static ssize_t comp_algorithm_store(struct device *dev,
 	return len;
 }
 
+static ssize_t recomp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	size_t sz;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	sz = zcomp_available_show(zram->recomp_algorithm, buf);
+	up_read(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t recomp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change algorithm for initialized device\n");
+		return -EBUSY;
+	}
+	if (sysfs_streq(buf, "none"))
+		zram->recomp_algorithm[0] = '\0';
+	else
+		strlcpy(zram->recomp_algorithm, buf,
+				sizeof(zram->recomp_algorithm));
+	up_write(&zram->init_lock);
+	return len;
+}
+
+static ssize_t use_dedup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->use_dedup;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", (int)val);
+}
+
+#ifdef CONFIG_ZRAM_DEDUP
+static ssize_t use_dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (kstrtoint(buf, 10, &val) || (val != 0 && val != 1))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change dedup usage for initialized device\n");
+		return -EBUSY;
+	}
+	zram->use_dedup = val;
+	up_write(&zram->init_lock);
+	return len;
+}
+#endif
+
 /* flag operations needs meta->tb_lock */
 static int zram_test_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
@@ -370,21 +521,79 @@ static inline int valid_io_request(struct zram *zram,
 	return 1;
 }
 
-static void zram_meta_free(struct zram_meta *meta, u64 disksize)
+static unsigned long zram_entry_handle(struct zram *zram,
+				struct zram_entry *entry)
+{
+	if (zram_dedup_enabled(zram))
+		return entry->handle;
+
+	return (unsigned long)entry;
+}
+
+static struct zram_entry *zram_entry_alloc(struct zram *zram,
+				struct zram_meta *meta, unsigned int len,
+				gfp_t flags)
+{
+	struct zram_entry *entry;
+	unsigned long handle;
+
+	handle = zs_malloc(meta->mem_pool, len, flags);
+	if (!handle)
+		return NULL;
+
+	if (!zram_dedup_enabled(zram))
+		return (struct zram_entry *)handle;
+
+	entry = kmalloc(sizeof(*entry), flags & ~__GFP_HIGHMEM);
+	if (!entry) {
+		zs_free(meta->mem_pool, handle);
+		return NULL;
+	}
+
+	zram_dedup_init_entry(zram, entry, handle, len);
+	atomic64_add(sizeof(*entry), &zram->stats.meta_data_size);
+
+	return entry;
+}
+
+void zram_entry_free(struct zram *zram, struct zram_entry *entry)
+{
+	if (!zram_dedup_put_entry(zram, entry))
+		return;
+
+	zs_free(zram->meta->mem_pool, zram_entry_handle(zram, entry));
+
+	if (!zram_dedup_enabled(zram))
+		return;
+
+	kfree(entry);
+	atomic64_sub(sizeof(*entry), &zram->stats.meta_data_size);
+}
+
+static void zram_meta_free(struct zram *zram, struct zram_meta *meta,
+				u64 disksize)
 {
 	size_t num_pages = disksize >> PAGE_SHIFT;
 	size_t index;
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < num_pages; index++) {
-		unsigned long handle = meta->table[index].handle;
+		struct zram_entry *entry = meta->table[index].entry;
 
-		if (!handle)
+		/* Backing device blocks go away with the bitmap */
+		if (!entry || zram_test_flag(meta, index, ZRAM_WB))
 			continue;
 
-		zs_free(meta->mem_pool, handle);
+		/* No concurrent users left, refcount needs no locking */
+		if (zram_dedup_enabled(zram) && --entry->refcount)
+			continue;
+
+		zs_free(meta->mem_pool, zram_entry_handle(zram, entry));
+		if (zram_dedup_enabled(zram))
+			kfree(entry);
 	}
 
+	zram_dedup_fini(meta);
 	zs_destroy_pool(meta->mem_pool);
 	vfree(meta->table);
 	kfree(meta);
@@ -394,7 +603,7 @@ static struct zram_meta *zram_meta_alloc(int device_id, u64 disksize)
 {
 	size_t num_pages;
 	char pool_name[8];
-	struct zram_meta *meta = kmalloc(sizeof(*meta), GFP_KERNEL);
+	struct zram_meta *meta = kzalloc(sizeof(*meta), GFP_KERNEL);
 
 	if (!meta)
 		return NULL;
@@ -407,8 +616,7 @@ static struct zram_meta *zram_meta_alloc(int device_id, u64 disksize)
 	}
 
 	snprintf(pool_name, sizeof(pool_name), "zram%d", device_id);
-	meta->mem_pool = zs_create_pool(pool_name, GFP_NOIO | __GFP_HIGHMEM |
-					__GFP_NOWARN);
+	meta->mem_pool = zs_create_pool(pool_name, ZRAM_GFP);
 	if (!meta->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		goto out_error;
@@ -471,6 +679,472 @@ static void handle_zero_page(struct bio_vec *bvec)
 	flush_dcache_page(page);
 }
 
+#ifdef CONFIG_ZRAM_MEMORY_TRACKING
+static struct dentry *zram_debugfs_root;
+
+static void zram_debugfs_create(void)
+{
+	zram_debugfs_root = debugfs_create_dir("zram", NULL);
+}
+
+static void zram_debugfs_destroy(void)
+{
+	debugfs_remove_recursive(zram_debugfs_root);
+}
+
+/* Called with the slot locked */
+static void zram_accessed(struct zram *zram, u32 index)
+{
+	struct zram_meta *meta = zram->meta;
+
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	meta->table[index].ac_time = ktime_get_boottime();
+}
+
+static bool zram_accessed_before(struct zram_meta *meta, u32 index,
+				 ktime_t cutoff)
+{
+	/* a zero cutoff means any slot */
+	if (!cutoff.tv64)
+		return true;
+
+	return meta->table[index].ac_time.tv64 <= cutoff.tv64;
+}
+
+/*
+ * One line per allocated slot: index, seconds since the last access,
+ * object size and flags (z: zero, h: huge, w: written back, i: idle,
+ * r: recompressed).
+ */
+static ssize_t read_block_state(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	char *kbuf;
+	ssize_t index, written = 0;
+	struct zram *zram = file->private_data;
+	struct zram_meta *meta;
+	unsigned long nr_pages;
+	ktime_t now = ktime_get_boottime();
+
+	kbuf = vmalloc(count);
+	if (!kbuf)
+		return -ENOMEM;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		vfree(kbuf);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = *ppos; index < nr_pages; index++) {
+		struct timespec age;
+		int copied;
+
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (!meta->table[index].entry &&
+				!zram_test_flag(meta, index, ZRAM_ZERO))
+			goto next;
+
+		age = ktime_to_timespec(ktime_sub(now,
+					meta->table[index].ac_time));
+		copied = snprintf(kbuf + written, count,
+			"%12zd %12lu.%06lu %8zu %c%c%c%c%c\n",
+			index, (unsigned long)age.tv_sec,
+			age.tv_nsec / NSEC_PER_USEC,
+			zram_test_flag(meta, index, ZRAM_WB) ? 0 :
+				zram_get_obj_size(meta, index),
+			zram_test_flag(meta, index, ZRAM_ZERO) ? 'z' : '.',
+			zram_test_flag(meta, index, ZRAM_HUGE) ? 'h' : '.',
+			zram_test_flag(meta, index, ZRAM_WB) ? 'w' : '.',
+			zram_test_flag(meta, index, ZRAM_IDLE) ? 'i' : '.',
+			zram_test_flag(meta, index, ZRAM_RECOMP) ? 'r' : '.');
+
+		if (count <= copied) {
+			bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+			break;
+		}
+		written += copied;
+		count -= copied;
+next:
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		*ppos += 1;
+	}
+
+	up_read(&zram->init_lock);
+	if (copy_to_user(buf, kbuf, written))
+		written = -EFAULT;
+	vfree(kbuf);
+
+	return written;
+}
+
+static const struct file_operations proc_zram_block_state_op = {
+	.open = simple_open,
+	.read = read_block_state,
+	.llseek = default_llseek,
+};
+
+static void zram_debugfs_register(struct zram *zram)
+{
+	if (!zram_debugfs_root)
+		return;
+
+	zram->debugfs_dir = debugfs_create_dir(zram->disk->disk_name,
+						zram_debugfs_root);
+	debugfs_create_file("block_state", 0400, zram->debugfs_dir,
+				zram, &proc_zram_block_state_op);
+}
+
+static void zram_debugfs_unregister(struct zram *zram)
+{
+	debugfs_remove_recursive(zram->debugfs_dir);
+}
+#else
+static inline void zram_debugfs_create(void) {}
+static inline void zram_debugfs_destroy(void) {}
+static inline void zram_accessed(struct zram *zram, u32 index)
+{
+	zram_clear_flag(zram->meta, index, ZRAM_IDLE);
+}
+static inline bool zram_accessed_before(struct zram_meta *meta, u32 index,
+					ktime_t cutoff)
+{
+	return true;
+}
+static inline void zram_debugfs_register(struct zram *zram) {}
+static inline void zram_debugfs_unregister(struct zram *zram) {}
+#endif
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static inline bool zram_wb_enabled(struct zram *zram)
+{
+	return zram->backing_dev;
+}
+
+static void reset_bdev(struct zram *zram)
+{
+	struct block_device *bdev;
+
+	if (!zram_wb_enabled(zram))
+		return;
+
+	bdev = zram->bdev;
+	if (zram->old_block_size)
+		set_blocksize(bdev, zram->old_block_size);
+	blkdev_put(bdev, FMODE_READ|FMODE_WRITE|FMODE_EXCL);
+	/* hope filp_close flush all of IO */
+	filp_close(zram->backing_dev, NULL);
+	zram->backing_dev = NULL;
+	zram->old_block_size = 0;
+	zram->bdev = NULL;
+
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct file *file;
+	char *p;
+	ssize_t ret;
+
+	down_read(&zram->init_lock);
+	file = zram->backing_dev;
+	if (!file) {
+		up_read(&zram->init_lock);
+		return scnprintf(buf, PAGE_SIZE, "none\n");
+	}
+
+	p = d_path(&file->f_path, buf, PAGE_SIZE - 1);
+	if (IS_ERR(p)) {
+		ret = PTR_ERR(p);
+		goto out;
+	}
+
+	ret = strlen(p);
+	memmove(buf, p, ret);
+	buf[ret++] = '\n';
+out:
+	up_read(&zram->init_lock);
+	return ret;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	char *file_name;
+	size_t sz;
+	struct file *backing_dev = NULL;
+	struct inode *inode;
+	unsigned int old_block_size = 0;
+	unsigned long nr_pages, *bitmap = NULL;
+	struct block_device *bdev = NULL;
+	int err;
+	struct zram *zram = dev_to_zram(dev);
+
+	file_name = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!file_name)
+		return -ENOMEM;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		pr_info("Can't setup backing device for initialized device\n");
+		err = -EBUSY;
+		goto out;
+	}
+
+	strlcpy(file_name, buf, PATH_MAX);
+	/* ignore trailing newline */
+	sz = strlen(file_name);
+	if (sz > 0 && file_name[sz - 1] == '\n')
+		file_name[sz - 1] = 0x00;
+
+	backing_dev = filp_open(file_name, O_RDWR|O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev)) {
+		err = PTR_ERR(backing_dev);
+		backing_dev = NULL;
+		goto out;
+	}
+
+	inode = backing_dev->f_mapping->host;
+
+	/* Support only block device in this moment */
+	if (!S_ISBLK(inode->i_mode)) {
+		err = -ENOTBLK;
+		goto out;
+	}
+
+	bdev = bdgrab(I_BDEV(inode));
+	err = blkdev_get(bdev, FMODE_READ|FMODE_WRITE|FMODE_EXCL, zram);
+	if (err < 0) {
+		bdev = NULL;
+		goto out;
+	}
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	old_block_size = block_size(bdev);
+	err = set_blocksize(bdev, PAGE_SIZE);
+	if (err)
+		goto out;
+
+	reset_bdev(zram);
+	spin_lock_init(&zram->bitmap_lock);
+
+	zram->old_block_size = old_block_size;
+	zram->bdev = bdev;
+	zram->backing_dev = backing_dev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+	up_write(&zram->init_lock);
+
+	pr_info("setup backing device %s\n", file_name);
+	kfree(file_name);
+
+	return len;
+out:
+	vfree(bitmap);
+
+	if (bdev)
+		blkdev_put(bdev, FMODE_READ|FMODE_WRITE|FMODE_EXCL);
+
+	if (backing_dev)
+		filp_close(backing_dev, NULL);
+
+	up_write(&zram->init_lock);
+
+	kfree(file_name);
+
+	return err;
+}
+
+/*
+ * Allocate a free page on the backing device. Page 0 is never
+ * handed out so that a zero table handle still means "empty slot".
+ */
+static unsigned long alloc_block_bdev(struct zram *zram)
+{
+	unsigned long blk_idx;
+
+	spin_lock(&zram->bitmap_lock);
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, 1);
+	if (blk_idx >= zram->nr_pages) {
+		spin_unlock(&zram->bitmap_lock);
+		return 0;
+	}
+	set_bit(blk_idx, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+
+	atomic64_inc(&zram->stats.bd_count);
+	return blk_idx;
+}
+
+static void free_block_bdev(struct zram *zram, unsigned long blk_idx)
+{
+	int was_set;
+
+	spin_lock(&zram->bitmap_lock);
+	was_set = test_and_clear_bit(blk_idx, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+	WARN_ON_ONCE(!was_set);
+
+	atomic64_dec(&zram->stats.bd_count);
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Synchronously transfer one page to or from the backing device.
+ * Must be called from process context.
+ */
+static int __zram_bdev_rw(struct zram *zram, struct page *page,
+			  unsigned long blk_idx, int rw)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret = 0;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw | REQ_SYNC, bio);
+	wait_for_completion(&done);
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		ret = -EIO;
+	bio_put(bio);
+
+	if (rw == READ)
+		atomic64_inc(&zram->stats.bd_reads);
+	else
+		atomic64_inc(&zram->stats.bd_writes);
+	return ret;
+}
+
+struct zram_bdev_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int rw;
+	int ret;
+};
+
+static void zram_bdev_rw_work(struct work_struct *work)
+{
+	struct zram_bdev_work *zw = container_of(work, struct zram_bdev_work,
+						 work);
+
+	zw->ret = __zram_bdev_rw(zw->zram, zw->page, zw->blk_idx, zw->rw);
+}
+
+/*
+ * Inside zram_make_request() generic_make_request() only queues the bio
+ * we submit on current->bio_list, to be issued after we return, so
+ * waiting for it there would never finish. Do the transfer from a worker
+ * in that case.
+ */
+static int zram_bdev_rw(struct zram *zram, struct page *page,
+			unsigned long blk_idx, int rw)
+{
+	struct zram_bdev_work zw;
+
+	if (!current->bio_list)
+		return __zram_bdev_rw(zram, page, blk_idx, rw);
+
+	zw.zram = zram;
+	zw.page = page;
+	zw.blk_idx = blk_idx;
+	zw.rw = rw;
+	INIT_WORK_ONSTACK(&zw.work, zram_bdev_rw_work);
+	queue_work(system_unbound_wq, &zw.work);
+	flush_work(&zw.work);
+	destroy_work_on_stack(&zw.work);
+
+	return zw.ret;
+}
+
+/* Read a written back page into the (lowmem or kmapped) buffer @mem */
+static int read_from_bdev(struct zram *zram, char *mem, unsigned long blk_idx)
+{
+	struct page *page;
+	void *src;
+	int ret;
+
+	page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_bdev_rw(zram, page, blk_idx, READ);
+	if (!ret) {
+		src = kmap_atomic(page);
+		copy_page(mem, src);
+		kunmap_atomic(src);
+	}
+	__free_page(page);
+	return ret;
+}
+
+/* Read a written back page straight into the bio page of @bvec */
+static int zram_bvec_read_bdev(struct zram *zram, struct bio_vec *bvec,
+			       unsigned long blk_idx, int offset)
+{
+	unsigned char *user_mem, *uncmem;
+	int ret;
+
+	if (!is_partial_io(bvec)) {
+		ret = zram_bdev_rw(zram, bvec->bv_page, blk_idx, READ);
+		if (!ret)
+			flush_dcache_page(bvec->bv_page);
+		return ret;
+	}
+
+	uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+	if (!uncmem)
+		return -ENOMEM;
+
+	ret = read_from_bdev(zram, uncmem, blk_idx);
+	if (!ret) {
+		user_mem = kmap_atomic(bvec->bv_page);
+		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+				bvec->bv_len);
+		kunmap_atomic(user_mem);
+		flush_dcache_page(bvec->bv_page);
+	}
+	kfree(uncmem);
+	return ret;
+}
+#else
+static inline bool zram_wb_enabled(struct zram *zram) { return false; }
+static inline void reset_bdev(struct zram *zram) {};
+static inline void free_block_bdev(struct zram *zram,
+				   unsigned long blk_idx) {};
+#endif
+
 
 /*
  * To protect concurrent access to the same index entry,
@@ -480,9 +1154,29 @@ static void handle_zero_page(struct bio_vec *bvec)
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	struct zram_meta *meta = zram->meta;
-	unsigned long handle = meta->table[index].handle;
+	struct zram_entry *entry = meta->table[index].entry;
+
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	if (zram_test_flag(meta, index, ZRAM_HUGE)) {
+		zram_clear_flag(meta, index, ZRAM_HUGE);
+		atomic64_dec(&zram->stats.huge_pages);
+	}
+	zram_clear_flag(meta, index, ZRAM_INCOMPRESSIBLE);
+	zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+	if (zram_test_flag(meta, index, ZRAM_RECOMP)) {
+		zram_clear_flag(meta, index, ZRAM_RECOMP);
+		atomic64_dec(&zram->stats.recomp_pages);
+	}
+
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		zram_clear_flag(meta, index, ZRAM_WB);
+		free_block_bdev(zram, meta->table[index].element);
+		atomic64_dec(&zram->stats.pages_stored);
+		meta->table[index].element = 0;
+		return;
+	}
 
-	if (unlikely(!handle)) {
+	if (unlikely(!entry)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -494,13 +1188,13 @@ static void zram_free_page(struct zram *zram, size_t index)
 		return;
 	}
 
-	zs_free(meta->mem_pool, handle);
+	zram_entry_free(zram, entry);
 
 	atomic64_sub(zram_get_obj_size(meta, index),
 			&zram->stats.compr_data_size);
 	atomic64_dec(&zram->stats.pages_stored);
 
-	meta->table[index].handle = 0;
+	meta->table[index].entry = NULL;
 	zram_set_obj_size(meta, index, 0);
 }
 
@@ -509,24 +1203,37 @@ static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 	int ret = 0;
 	unsigned char *cmem;
 	struct zram_meta *meta = zram->meta;
+	struct zram_entry *entry;
+	struct zcomp *comp;
 	unsigned long handle;
 	size_t size;
 
 	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
-	handle = meta->table[index].handle;
+	entry = meta->table[index].entry;
 	size = zram_get_obj_size(meta, index);
 
-	if (!handle || zram_test_flag(meta, index, ZRAM_ZERO)) {
+	if (!entry || zram_test_flag(meta, index, ZRAM_ZERO)) {
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 		clear_page(mem);
 		return 0;
 	}
 
+	/* The page lives on the backing device, let the caller fetch it */
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		return -EAGAIN;
+	}
+
+	comp = zram->comp;
+	if (zram_test_flag(meta, index, ZRAM_RECOMP))
+		comp = zram->recomp;
+
+	handle = zram_entry_handle(zram, entry);
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_RO);
 	if (size == PAGE_SIZE)
 		copy_page(mem, cmem);
 	else
-		ret = zcomp_decompress(zram->comp, cmem, size, mem);
+		ret = zcomp_decompress(comp, cmem, size, mem);
 	zs_unmap_object(meta->mem_pool, handle);
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
@@ -548,13 +1255,22 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	struct zram_meta *meta = zram->meta;
 	page = bvec->bv_page;
 
+again:
 	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
-	if (unlikely(!meta->table[index].handle) ||
+	if (unlikely(!meta->table[index].entry) ||
 			zram_test_flag(meta, index, ZRAM_ZERO)) {
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 		handle_zero_page(bvec);
 		return 0;
 	}
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		unsigned long blk_idx = meta->table[index].element;
+
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		return zram_bvec_read_bdev(zram, bvec, blk_idx, offset);
+	}
+#endif
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
 	if (is_partial_io(bvec))
@@ -586,6 +1302,9 @@ out_cleanup:
 	kunmap_atomic(user_mem);
 	if (is_partial_io(bvec))
 		kfree(uncmem);
+	/* Written back under us, retry from the backing device */
+	if (unlikely(ret == -EAGAIN))
+		goto again;
 	return ret;
 }
 
@@ -604,19 +1323,61 @@ static inline void update_used_max(struct zram *zram,
 	} while (old_max != cur_max);
 }
 
+/*
+ * Already compressed or encrypted data looks random: nearly every byte
+ * sampled across the page is a value not seen before. Text, code and
+ * heap data reuse a much smaller alphabet. Random data gives about 100
+ * distinct values out of 128 samples, so the threshold keeps clear of
+ * anything lz4 could shrink below max_zpage_size.
+ */
+#define PREDICT_SAMPLES		128
+#define PREDICT_STRIDE		(PAGE_SIZE / PREDICT_SAMPLES)
+#define PREDICT_DISTINCT	96
+/* Compress one out of this many predicted pages anyway */
+#define PREDICT_VERIFY_RATE	32
+
+static bool zram_predict_incompressible(const unsigned char *mem)
+{
+	DECLARE_BITMAP(seen, 256);
+	unsigned int i, distinct = 0;
+
+	bitmap_zero(seen, 256);
+	for (i = 0; i < PREDICT_SAMPLES; i++) {
+		/* vary the offset so a fixed record layout is not hit */
+		unsigned char c = mem[i * PREDICT_STRIDE + i % PREDICT_STRIDE];
+
+		if (!__test_and_set_bit(c, seen))
+			distinct++;
+	}
+
+	return distinct >= PREDICT_DISTINCT;
+}
+
+/* Returns true if a predicted page should be compressed for checking */
+static bool zram_predict_verify(struct zram *zram)
+{
+	if (atomic_inc_return(&zram->incomp_predicted) % PREDICT_VERIFY_RATE)
+		return false;
+
+	atomic64_inc(&zram->stats.incomp_verified);
+	return true;
+}
+
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret = 0;
-	size_t clen;
+	size_t clen, alloced_len = 0;
 	unsigned long handle;
+	struct zram_entry *entry = NULL;
 	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 	struct zram_meta *meta = zram->meta;
 	static unsigned long zram_rs_time;
 	struct zcomp_strm *zstrm;
-	bool locked = false;
+	bool locked = false, predicted;
 	unsigned long alloced_pages;
+	u32 checksum = 0;
 
 	page = bvec->bv_page;
 	if (is_partial_io(bvec)) {
@@ -630,10 +1391,21 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 		ret = zram_decompress_page(zram, uncmem, index);
+#ifdef CONFIG_ZRAM_WRITEBACK
+		if (ret == -EAGAIN) {
+			unsigned long blk_idx;
+
+			bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+			blk_idx = meta->table[index].element;
+			bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+			ret = read_from_bdev(zram, uncmem, blk_idx);
+		}
+#endif
 		if (ret)
 			goto out;
 	}
 
+compress_again:
 	zstrm = zcomp_strm_find(zram->comp);
 	locked = true;
 	user_mem = kmap_atomic(page);
@@ -657,11 +1429,35 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
 		atomic64_inc(&zram->stats.zero_pages);
+		/* The page changed since the slow path allocation */
+		if (entry)
+			zram_entry_free(zram, entry);
+		ret = 0;
+		goto out;
+	}
+
+	/* The slow path below already did the lookup */
+	if (zram_dedup_enabled(zram) && !entry) {
+		checksum = zram_dedup_checksum(uncmem);
+		entry = zram_dedup_find(zram, zstrm, uncmem, checksum);
+		if (entry) {
+			if (user_mem)
+				kunmap_atomic(user_mem);
+			clen = entry->len;
+			goto found_dup;
+		}
+	}
+
+	predicted = zram->incomp_predict && zram_predict_incompressible(uncmem);
+	if (predicted && !zram_predict_verify(zram)) {
+		atomic64_inc(&zram->stats.incomp_skipped);
+		clen = PAGE_SIZE;
 		ret = 0;
-		goto out;
+	} else {
+		ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
+		if (predicted && !ret && clen <= max_zpage_size)
+			atomic64_inc(&zram->stats.incomp_mispredicted);
 	}
-
-	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
 	if (!is_partial_io(bvec)) {
 		kunmap_atomic(user_mem);
 		user_mem = NULL;
@@ -679,8 +1475,38 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			src = uncmem;
 	}
 
-	handle = zs_malloc(meta->mem_pool, clen);
-	if (!handle) {
+	if (entry && alloced_len != clen) {
+		zram_entry_free(zram, entry);
+		entry = NULL;
+	}
+
+	/*
+	 * Entry allocation has 2 paths:
+	 * a) fast path runs while we hold the compression stream; with
+	 *  per-cpu streams preemption is disabled, so it must not sleep;
+	 * b) slow path drops the stream and allocates with reclaim
+	 *  allowed. The stream buffer may be reused by somebody else
+	 *  meanwhile, so the page has to be compressed again.
+	 *
+	 * A non-NULL entry here means we come back from the slow path.
+	 */
+	if (!entry && zcomp_strm_atomic(zram->comp)) {
+		entry = zram_entry_alloc(zram, meta, clen, ZRAM_GFP_ATOMIC);
+		if (!entry) {
+			zcomp_strm_release(zram->comp, zstrm);
+			locked = false;
+			atomic64_inc(&zram->stats.writestall);
+			entry = zram_entry_alloc(zram, meta, clen, ZRAM_GFP);
+			if (entry) {
+				alloced_len = clen;
+				goto compress_again;
+			}
+		}
+	} else if (!entry) {
+		entry = zram_entry_alloc(zram, meta, clen, ZRAM_GFP);
+	}
+
+	if (!entry) {
 		if (printk_timed_ratelimit(&zram_rs_time,
 					   ALLOC_ERROR_LOG_RATE_MS))
 			pr_info("Error allocating memory for compressed page: %u, size=%zu\n",
@@ -691,13 +1517,14 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 
 	alloced_pages = zs_get_total_pages(meta->mem_pool);
 	if (zram->limit_pages && alloced_pages > zram->limit_pages) {
-		zs_free(meta->mem_pool, handle);
+		zram_entry_free(zram, entry);
 		ret = -ENOMEM;
 		goto out;
 	}
 
 	update_used_max(zram, alloced_pages);
 
+	handle = zram_entry_handle(zram, entry);
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
 
 	if ((clen == PAGE_SIZE) && !is_partial_io(bvec)) {
@@ -711,6 +1538,13 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	zcomp_strm_release(zram->comp, zstrm);
 	locked = false;
 	zs_unmap_object(meta->mem_pool, handle);
+	zram_dedup_insert(zram, entry, checksum);
+
+found_dup:
+	if (locked) {
+		zcomp_strm_release(zram->comp, zstrm);
+		locked = false;
+	}
 
 	/*
 	 * Free memory associated with this sector
@@ -719,8 +1553,12 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
 	zram_free_page(zram, index);
 
-	meta->table[index].handle = handle;
+	meta->table[index].entry = entry;
 	zram_set_obj_size(meta, index, clen);
+	if (clen == PAGE_SIZE) {
+		zram_set_flag(meta, index, ZRAM_HUGE);
+		atomic64_inc(&zram->stats.huge_pages);
+	}
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
 	/* Update stats */
@@ -751,6 +1589,14 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 		ret = zram_bvec_write(zram, bvec, index, offset);
 	}
 
+	if (!ret) {
+		struct zram_meta *meta = zram->meta;
+
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		zram_accessed(zram, index);
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	}
+
 	generic_end_io_acct(rw, &zram->disk->part0, start_time);
 
 	if (unlikely(ret)) {
@@ -802,10 +1648,486 @@ static void zram_bio_discard(struct zram *zram, u32 index,
 	}
 }
 
+#if defined(CONFIG_ZRAM_WRITEBACK) || defined(CONFIG_ZRAM_MEMORY_TRACKING)
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	unsigned long nr_pages;
+	unsigned long index;
+	ktime_t cutoff = ktime_set(0, 0);
+
+	if (!sysfs_streq(buf, "all")) {
+#ifdef CONFIG_ZRAM_MEMORY_TRACKING
+		ktime_t now = ktime_get_boottime();
+		unsigned long age;
+
+		/* Only pages not accessed for @age seconds */
+		if (kstrtoul(buf, 10, &age))
+			return -EINVAL;
+		/* nothing can be older than the uptime */
+		if (age >= div_u64(ktime_to_ns(now), NSEC_PER_SEC))
+			return len;
+		cutoff = ktime_sub(now, ktime_set(age, 0));
+#else
+		return -EINVAL;
+#endif
+	}
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		/*
+		 * Do not mark ZRAM_UNDER_WB slots, writeback_store relies
+		 * on ZRAM_IDLE to detect that the slot changed under it.
+		 */
+		if (meta->table[index].entry &&
+				!zram_test_flag(meta, index, ZRAM_WB) &&
+				!zram_test_flag(meta, index, ZRAM_UNDER_WB) &&
+				zram_accessed_before(meta, index, cutoff))
+			zram_set_flag(meta, index, ZRAM_IDLE);
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	}
+	up_read(&zram->init_lock);
+
+	return len;
+}
+#endif
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+
+#define IDLE_WRITEBACK	(1 << 0)
+#define HUGE_WRITEBACK	(1 << 1)
+
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	unsigned long nr_pages, index;
+	unsigned long blk_idx = 0;
+	struct page *page;
+	void *mem;
+	ssize_t ret;
+	int mode;
+
+	if (sysfs_streq(buf, "idle"))
+		mode = IDLE_WRITEBACK;
+	else if (sysfs_streq(buf, "huge"))
+		mode = HUGE_WRITEBACK;
+	else
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		ret = -EINVAL;
+		goto release_init_lock;
+	}
+
+	if (!zram_wb_enabled(zram)) {
+		ret = -ENODEV;
+		goto release_init_lock;
+	}
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		ret = -ENOMEM;
+		goto release_init_lock;
+	}
+
+	ret = len;
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		int err;
+
+		if (!blk_idx) {
+			blk_idx = alloc_block_bdev(zram);
+			if (!blk_idx) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
+
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (!meta->table[index].entry ||
+				zram_test_flag(meta, index, ZRAM_ZERO) ||
+				zram_test_flag(meta, index, ZRAM_WB) ||
+				zram_test_flag(meta, index, ZRAM_UNDER_WB) ||
+				zram_test_flag(meta, index, ZRAM_UNDER_RECOMP))
+			goto next;
+
+		if ((mode & IDLE_WRITEBACK) &&
+				!zram_test_flag(meta, index, ZRAM_IDLE))
+			goto next;
+		if ((mode & HUGE_WRITEBACK) &&
+				!zram_test_flag(meta, index, ZRAM_HUGE))
+			goto next;
+		/*
+		 * Clearing ZRAM_UNDER_WB is duty of caller.
+		 * IOW, zram_free_page never clear it.
+		 */
+		zram_set_flag(meta, index, ZRAM_UNDER_WB);
+		/* Need for huge page writeback racing */
+		zram_set_flag(meta, index, ZRAM_IDLE);
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+		mem = kmap(page);
+		err = zram_decompress_page(zram, mem, index);
+		kunmap(page);
+		if (!err)
+			err = zram_bdev_rw(zram, page, blk_idx, WRITE);
+
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (err) {
+			zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+			zram_clear_flag(meta, index, ZRAM_IDLE);
+			bit_spin_unlock(ZRAM_ACCESS,
+					&meta->table[index].value);
+			/*
+			 * Return last IO error unless every IO were
+			 * not suceeded.
+			 */
+			ret = err;
+			continue;
+		}
+
+		/*
+		 * We dropped the slot lock during the IO, so the slot may
+		 * have been freed or rewritten meanwhile. zram_free_page()
+		 * clears ZRAM_IDLE and idle_store skips ZRAM_UNDER_WB slots,
+		 * so a set ZRAM_IDLE bit means the slot is still the one
+		 * we have just written out.
+		 */
+		if (!meta->table[index].entry ||
+				!zram_test_flag(meta, index, ZRAM_IDLE)) {
+			zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+			zram_clear_flag(meta, index, ZRAM_IDLE);
+			goto next;
+		}
+
+		zram_free_page(zram, index);
+		zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+		zram_set_flag(meta, index, ZRAM_WB);
+		meta->table[index].element = blk_idx;
+		blk_idx = 0;
+		atomic64_inc(&zram->stats.pages_stored);
+next:
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	}
+
+	if (blk_idx)
+		free_block_bdev(zram, blk_idx);
+	__free_page(page);
+release_init_lock:
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+
+static ssize_t bd_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	ssize_t ret;
+
+	down_read(&zram->init_lock);
+	ret = scnprintf(buf, PAGE_SIZE,
+		"%8llu %8llu %8llu\n",
+		(u64)atomic64_read(&zram->stats.bd_count),
+		(u64)atomic64_read(&zram->stats.bd_reads),
+		(u64)atomic64_read(&zram->stats.bd_writes));
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+#endif
+
+#define IDLE_RECOMPRESS	(1 << 0)
+#define HUGE_RECOMPRESS	(1 << 1)
+
+/*
+ * Recompress a single slot with the secondary algorithm. Returns 0 if
+ * the slot was skipped or recompressed, negative errno on failure.
+ */
+static int zram_recompress(struct zram *zram, struct zcomp_strm *zstrm,
+			   u32 index, int mode, size_t threshold, void *mem)
+{
+	struct zram_meta *meta = zram->meta;
+	struct zram_entry *entry;
+	unsigned long handle;
+	unsigned char *cmem;
+	size_t old_size, clen;
+	bool was_idle;
+	int ret;
+
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	if (!meta->table[index].entry ||
+			zram_test_flag(meta, index, ZRAM_ZERO) ||
+			zram_test_flag(meta, index, ZRAM_WB) ||
+			zram_test_flag(meta, index, ZRAM_UNDER_WB) ||
+			zram_test_flag(meta, index, ZRAM_RECOMP) ||
+			zram_test_flag(meta, index, ZRAM_INCOMPRESSIBLE))
+		goto skip;
+
+	/* A copy for one of the sharers would only add memory */
+	if (zram_dedup_shared(zram, meta->table[index].entry))
+		goto skip;
+
+	was_idle = zram_test_flag(meta, index, ZRAM_IDLE);
+	if ((mode & IDLE_RECOMPRESS) && !was_idle)
+		goto skip;
+	if ((mode & HUGE_RECOMPRESS) &&
+			!zram_test_flag(meta, index, ZRAM_HUGE))
+		goto skip;
+
+	old_size = zram_get_obj_size(meta, index);
+	if (old_size < threshold)
+		goto skip;
+
+	/* zram_free_page() clears it if the slot changes under us */
+	zram_set_flag(meta, index, ZRAM_UNDER_RECOMP);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+	ret = zram_decompress_page(zram, mem, index);
+	if (ret)
+		goto out_clear;
+
+	ret = zcomp_compress(zram->recomp, zstrm, mem, &clen);
+	if (ret) {
+		pr_err("Recompression failed! err=%d\n", ret);
+		goto out_clear;
+	}
+
+	/* No point in keeping an object that did not shrink */
+	if (clen >= old_size || clen > max_zpage_size) {
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (zram_test_flag(meta, index, ZRAM_UNDER_RECOMP)) {
+			zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+			zram_set_flag(meta, index, ZRAM_INCOMPRESSIBLE);
+			atomic64_inc(&zram->stats.recomp_failed);
+		}
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		return 0;
+	}
+
+	entry = zram_entry_alloc(zram, meta, clen, ZRAM_GFP);
+	if (!entry) {
+		ret = -ENOMEM;
+		goto out_clear;
+	}
+
+	handle = zram_entry_handle(zram, entry);
+	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(meta->mem_pool, handle);
+
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	if (!zram_test_flag(meta, index, ZRAM_UNDER_RECOMP) ||
+			zram_dedup_shared(zram, meta->table[index].entry)) {
+		/* Slot was freed, rewritten or deduplicated against meanwhile */
+		zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		zram_entry_free(zram, entry);
+		return 0;
+	}
+
+	/*
+	 * The new entry is not inserted into the dedup tree: dedup
+	 * compares candidates with the primary algorithm only.
+	 */
+	zram_free_page(zram, index);
+	meta->table[index].entry = entry;
+	zram_set_obj_size(meta, index, clen);
+	zram_set_flag(meta, index, ZRAM_RECOMP);
+	if (was_idle)
+		zram_set_flag(meta, index, ZRAM_IDLE);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+	atomic64_add(clen, &zram->stats.compr_data_size);
+	atomic64_inc(&zram->stats.pages_stored);
+	atomic64_inc(&zram->stats.recomp_pages);
+	atomic64_add(old_size - clen, &zram->stats.recomp_saved);
+	return 0;
+
+skip:
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	return 0;
+
+out_clear:
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	return ret;
+}
+
+/*
+ * Accepts "type=idle|huge|huge_idle" and an optional "threshold=<bytes>";
+ * only objects at least threshold bytes large are recompressed.
+ */
+static ssize_t recompress_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	unsigned long nr_pages, index;
+	struct zcomp_strm *zstrm;
+	size_t threshold = 0;
+	char *args, *param, *val, *p;
+	int mode = 0;
+	void *mem;
+	ssize_t ret = len;
+
+	p = args = kstrndup(buf, len, GFP_KERNEL);
+	if (!args)
+		return -ENOMEM;
+
+	while ((param = strsep(&p, " \n")) != NULL) {
+		if (!*param)
+			continue;
+
+		val = strchr(param, '=');
+		if (!val) {
+			ret = -EINVAL;
+			goto out_free_args;
+		}
+		*val++ = '\0';
+
+		if (!strcmp(param, "type")) {
+			if (!strcmp(val, "idle"))
+				mode = IDLE_RECOMPRESS;
+			else if (!strcmp(val, "huge"))
+				mode = HUGE_RECOMPRESS;
+			else if (!strcmp(val, "huge_idle"))
+				mode = IDLE_RECOMPRESS | HUGE_RECOMPRESS;
+			else
+				ret = -EINVAL;
+		} else if (!strcmp(param, "threshold")) {
+			unsigned long tmp;
+
+			if (kstrtoul(val, 10, &tmp) || tmp > PAGE_SIZE)
+				ret = -EINVAL;
+			threshold = tmp;
+		} else {
+			ret = -EINVAL;
+		}
+
+		if (ret < 0)
+			goto out_free_args;
+	}
+
+	if (!mode) {
+		ret = -EINVAL;
+		goto out_free_args;
+	}
+
+	mem = (void *)__get_free_page(GFP_KERNEL);
+	if (!mem) {
+		ret = -ENOMEM;
+		goto out_free_args;
+	}
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		ret = -EINVAL;
+		goto release_init_lock;
+	}
+
+	if (!zram->recomp) {
+		ret = -ENODEV;
+		goto release_init_lock;
+	}
+
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		int err;
+
+		zstrm = zcomp_strm_find(zram->recomp);
+		err = zram_recompress(zram, zstrm, index, mode, threshold, mem);
+		zcomp_strm_release(zram->recomp, zstrm);
+		if (err) {
+			ret = err;
+			break;
+		}
+
+		cond_resched();
+	}
+
+release_init_lock:
+	up_read(&zram->init_lock);
+	free_page((unsigned long)mem);
+out_free_args:
+	kfree(args);
+	return ret;
+}
+
+static ssize_t recomp_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	ssize_t ret;
+
+	down_read(&zram->init_lock);
+	ret = scnprintf(buf, PAGE_SIZE,
+			"%8llu %8llu %8llu\n",
+			(u64)atomic64_read(&zram->stats.recomp_pages),
+			(u64)atomic64_read(&zram->stats.recomp_saved),
+			(u64)atomic64_read(&zram->stats.recomp_failed));
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+
+static ssize_t incomp_predict_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", (int)zram->incomp_predict);
+}
+
+static ssize_t incomp_predict_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (kstrtoint(buf, 10, &val) || (val != 0 && val != 1))
+		return -EINVAL;
+
+	zram->incomp_predict = val;
+	return len;
+}
+
+static ssize_t incomp_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	ssize_t ret;
+
+	down_read(&zram->init_lock);
+	ret = scnprintf(buf, PAGE_SIZE,
+			"%8llu %8llu %8llu %8llu\n",
+			(u64)atomic64_read(&zram->stats.incomp_skipped),
+			(u64)atomic64_read(&zram->stats.incomp_verified),
+			(u64)atomic64_read(&zram->stats.incomp_mispredicted),
+			(u64)atomic64_read(&zram->stats.huge_pages));
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+
 static void zram_reset_device(struct zram *zram)
 {
 	struct zram_meta *meta;
-	struct zcomp *comp;
+	struct zcomp *comp, *recomp;
 	u64 disksize;
 
 	down_write(&zram->init_lock);
@@ -819,6 +2141,7 @@ static void zram_reset_device(struct zram *zram)
 
 	meta = zram->meta;
 	comp = zram->comp;
+	recomp = zram->recomp;
 	disksize = zram->disksize;
 	/*
 	 * Refcount will go down to 0 eventually and r/w handler
@@ -836,19 +2159,23 @@ static void zram_reset_device(struct zram *zram)
 	memset(&zram->stats, 0, sizeof(zram->stats));
 	zram->disksize = 0;
 	zram->max_comp_streams = 1;
+	zram->recomp = NULL;
 	set_capacity(zram->disk, 0);
 
 	up_write(&zram->init_lock);
 	/* I/O operation under all of CPU are done so let's free */
-	zram_meta_free(meta, disksize);
+	zram_meta_free(zram, meta, disksize);
 	zcomp_destroy(comp);
+	if (recomp)
+		zcomp_destroy(recomp);
+	reset_bdev(zram);
 }
 
 static ssize_t disksize_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t len)
 {
 	u64 disksize;
-	struct zcomp *comp;
+	struct zcomp *comp, *recomp = NULL;
 	struct zram_meta *meta;
 	struct zram *zram = dev_to_zram(dev);
 	int err;
@@ -861,8 +2188,16 @@ static ssize_t disksize_store(struct device *dev,
 	meta = zram_meta_alloc(zram->disk->first_minor, disksize);
 	if (!meta)
 		return -ENOMEM;
+	zs_set_compact_threshold(meta->mem_pool, zram->compact_threshold);
 
-	comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (zram_dedup_enabled(zram)) {
+		err = zram_dedup_init(meta, disksize >> PAGE_SHIFT);
+		if (err)
+			goto out_free_meta;
+	}
+
+	comp = zcomp_create(zram->compressor, zram->max_comp_streams,
+			zram->percpu_streams);
 	if (IS_ERR(comp)) {
 		pr_info("Cannot initialise %s compressing backend\n",
 				zram->compressor);
@@ -870,6 +2205,18 @@ static ssize_t disksize_store(struct device *dev,
 		goto out_free_meta;
 	}
 
+	if (zram->recomp_algorithm[0]) {
+		/* recompress_store runs one stream at a time */
+		recomp = zcomp_create(zram->recomp_algorithm, 1, false);
+		if (IS_ERR(recomp)) {
+			pr_info("Cannot initialise %s recompressing backend\n",
+					zram->recomp_algorithm);
+			err = PTR_ERR(recomp);
+			recomp = NULL;
+			goto out_destroy_comp_unlocked;
+		}
+	}
+
 	down_write(&zram->init_lock);
 	if (init_done(zram)) {
 		pr_info("Cannot change disksize for initialized device\n");
@@ -881,6 +2228,7 @@ static ssize_t disksize_store(struct device *dev,
 	atomic_set(&zram->refcount, 1);
 	zram->meta = meta;
 	zram->comp = comp;
+	zram->recomp = recomp;
 	zram->disksize = disksize;
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 	up_write(&zram->init_lock);
@@ -896,9 +2244,12 @@ static ssize_t disksize_store(struct device *dev,
 
 out_destroy_comp:
 	up_write(&zram->init_lock);
+out_destroy_comp_unlocked:
+	if (recomp)
+		zcomp_destroy(recomp);
 	zcomp_destroy(comp);
 out_free_meta:
-	zram_meta_free(meta, disksize);
+	zram_meta_free(zram, meta, disksize);
 	return err;
 }
 
@@ -1091,6 +2442,8 @@ static const struct block_device_operations zram_devops = {
 };
 
 static DEVICE_ATTR_WO(compact);
+static DEVICE_ATTR_RW(compact_threshold);
+static DEVICE_ATTR_RO(compact_stat);
 static DEVICE_ATTR_RW(disksize);
 static DEVICE_ATTR_RO(initstate);
 static DEVICE_ATTR_WO(reset);
@@ -1099,7 +2452,26 @@ static DEVICE_ATTR_RO(mem_used_total);
 static DEVICE_ATTR_RW(mem_limit);
 static DEVICE_ATTR_RW(mem_used_max);
 static DEVICE_ATTR_RW(max_comp_streams);
+static DEVICE_ATTR_RW(percpu_streams);
+static DEVICE_ATTR_RW(incomp_predict);
+static DEVICE_ATTR_RO(incomp_stat);
 static DEVICE_ATTR_RW(comp_algorithm);
+static DEVICE_ATTR_RW(recomp_algorithm);
+static DEVICE_ATTR_WO(recompress);
+static DEVICE_ATTR_RO(recomp_stat);
+#ifdef CONFIG_ZRAM_DEDUP
+static DEVICE_ATTR_RW(use_dedup);
+#else
+static DEVICE_ATTR_RO(use_dedup);
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+static DEVICE_ATTR_RW(backing_dev);
+static DEVICE_ATTR_WO(writeback);
+static DEVICE_ATTR_RO(bd_stat);
+#endif
+#if defined(CONFIG_ZRAM_WRITEBACK) || defined(CONFIG_ZRAM_MEMORY_TRACKING)
+static DEVICE_ATTR_WO(idle);
+#endif
 
 static ssize_t io_stat_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
@@ -1109,11 +2481,12 @@ static ssize_t io_stat_show(struct device *dev,
 
 	down_read(&zram->init_lock);
 	ret = scnprintf(buf, PAGE_SIZE,
-			"%8llu %8llu %8llu %8llu\n",
+			"%8llu %8llu %8llu %8llu %8llu\n",
 			(u64)atomic64_read(&zram->stats.failed_reads),
 			(u64)atomic64_read(&zram->stats.failed_writes),
 			(u64)atomic64_read(&zram->stats.invalid_io),
-			(u64)atomic64_read(&zram->stats.notify_free));
+			(u64)atomic64_read(&zram->stats.notify_free),
+			(u64)atomic64_read(&zram->stats.writestall));
 	up_read(&zram->init_lock);
 
 	return ret;
@@ -1135,14 +2508,16 @@ static ssize_t mm_stat_show(struct device *dev,
 	max_used = atomic_long_read(&zram->stats.max_used_pages);
 
 	ret = scnprintf(buf, PAGE_SIZE,
-			"%8llu %8llu %8llu %8lu %8ld %8llu %8llu\n",
+			"%8llu %8llu %8llu %8lu %8ld %8llu %8llu %8llu %8llu\n",
 			orig_size << PAGE_SHIFT,
 			(u64)atomic64_read(&zram->stats.compr_data_size),
 			mem_used << PAGE_SHIFT,
 			zram->limit_pages << PAGE_SHIFT,
 			max_used << PAGE_SHIFT,
 			(u64)atomic64_read(&zram->stats.zero_pages),
-			(u64)atomic64_read(&zram->stats.num_migrated));
+			(u64)atomic64_read(&zram->stats.num_migrated),
+			zram_dedup_dup_size(zram),
+			zram_dedup_meta_size(zram));
 	up_read(&zram->init_lock);
 
 	return ret;
@@ -1168,6 +2543,8 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_failed_reads.attr,
 	&dev_attr_failed_writes.attr,
 	&dev_attr_compact.attr,
+	&dev_attr_compact_threshold.attr,
+	&dev_attr_compact_stat.attr,
 	&dev_attr_invalid_io.attr,
 	&dev_attr_notify_free.attr,
 	&dev_attr_zero_pages.attr,
@@ -1177,9 +2554,24 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_mem_limit.attr,
 	&dev_attr_mem_used_max.attr,
 	&dev_attr_max_comp_streams.attr,
+	&dev_attr_percpu_streams.attr,
+	&dev_attr_incomp_predict.attr,
+	&dev_attr_incomp_stat.attr,
 	&dev_attr_comp_algorithm.attr,
 	&dev_attr_io_stat.attr,
 	&dev_attr_mm_stat.attr,
+	&dev_attr_use_dedup.attr,
+	&dev_attr_recomp_algorithm.attr,
+	&dev_attr_recompress.attr,
+	&dev_attr_recomp_stat.attr,
+#ifdef CONFIG_ZRAM_WRITEBACK
+	&dev_attr_backing_dev.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_stat.attr,
+#endif
+#if defined(CONFIG_ZRAM_WRITEBACK) || defined(CONFIG_ZRAM_MEMORY_TRACKING)
+	&dev_attr_idle.attr,
+#endif
 	NULL,
 };
 
@@ -1257,9 +2649,11 @@ static int create_device(struct zram *zram, int device_id)
 		pr_warn("Error creating sysfs group");
 		goto out_free_disk;
 	}
+	zram_debugfs_register(zram);
 	strlcpy(zram->compressor, default_compressor, sizeof(zram->compressor));
 	zram->meta = NULL;
 	zram->max_comp_streams = 1;
+	zram->incomp_predict = true;
 	return 0;
 
 out_free_disk:
@@ -1284,6 +2678,7 @@ static void destroy_devices(unsigned int nr)
 		 */
 		sysfs_remove_group(&disk_to_dev(zram->disk)->kobj,
 				&zram_disk_attr_group);
+		zram_debugfs_unregister(zram);
 
 		zram_reset_device(zram);
 
@@ -1294,6 +2689,7 @@ static void destroy_devices(unsigned int nr)
 
 	kfree(zram_devices);
 	unregister_blkdev(zram_major, "zram");
+	zram_debugfs_destroy();
 	pr_info("Destroyed %u device(s)\n", nr);
 }
 
@@ -1320,6 +2716,8 @@ static int __init zram_init(void)
 		return -ENOMEM;
 	}
 
+	zram_debugfs_create();
+
 	for (dev_id = 0; dev_id < zram_num_devices; dev_id++) {
 		ret = create_device(&zram_devices[dev_id], dev_id);
 		if (ret)
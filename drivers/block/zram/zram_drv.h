@@ -15,10 +15,13 @@
 #ifndef _ZRAM_DRV_H_
 #define _ZRAM_DRV_H_
 
+#include <linux/rbtree.h>
+#include <linux/ktime.h>
 #include <linux/spinlock.h>
 #include <linux/zsmalloc.h>
 
 #include "zcomp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -59,25 +62,55 @@ static const size_t max_zpage_size = PAGE_SIZE / 10 * 9;
  * zram is mainly used for memory efficiency so we want to keep memory
  * footprint small so we can squeeze size and flags into a field.
  * The lower ZRAM_FLAG_SHIFT bits is for object size (excluding header),
- * the higher bits is for zram_pageflags.
+ * the higher bits is for zram_pageflags. An object is never larger
+ * than PAGE_SIZE, so PAGE_SHIFT + 1 bits are enough for the size.
  */
-#define ZRAM_FLAG_SHIFT 24
+#define ZRAM_FLAG_SHIFT (PAGE_SHIFT + 1)
 
 /* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO = ZRAM_FLAG_SHIFT,
 	ZRAM_ACCESS,	/* page is now accessed */
+	ZRAM_WB,	/* page is stored on backing_device */
+	ZRAM_UNDER_WB,	/* page is under writeback */
+	ZRAM_HUGE,	/* incompressible page, stored uncompressed */
+	ZRAM_IDLE,	/* not accessed page since last idle marking */
+	ZRAM_RECOMP,	/* page is compressed with the secondary algorithm */
+	ZRAM_INCOMPRESSIBLE,	/* recompression would not shrink the page */
+	ZRAM_UNDER_RECOMP,	/* page is being recompressed */
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
-/* Allocated for each disk page */
-struct zram_table_entry {
+/*
+ * Describes one stored compressed object. Without deduplication the
+ * zsmalloc handle itself is stored in place of the pointer, so that no
+ * extra memory is spent per page; see zram_entry_handle().
+ */
+struct zram_entry {
+	struct rb_node rb_node;
+	u32 len;
+	u32 checksum;
+	unsigned long refcount;
 	unsigned long handle;
+};
+
+/*
+ * Allocated for each disk page. For ZRAM_WB pages, element holds the
+ * index of the block on the backing device instead of an entry.
+ */
+struct zram_table_entry {
+	union {
+		struct zram_entry *entry;
+		unsigned long element;
+	};
 	unsigned long value;
+#ifdef CONFIG_ZRAM_MEMORY_TRACKING
+	ktime_t ac_time;	/* last read or write */
+#endif
 };
 
 struct zram_stats {
@@ -89,19 +122,44 @@ struct zram_stats {
 	atomic64_t failed_writes;	/* can happen when memory is too low */
 	atomic64_t invalid_io;	/* non-page-aligned I/O requests */
 	atomic64_t notify_free;	/* no. of swap slot free notifications */
+	atomic64_t writestall;	/* no. of write slow paths */
 	atomic64_t zero_pages;		/* no. of zero filled pages */
 	atomic64_t pages_stored;	/* no. of pages currently stored */
 	atomic_long_t max_used_pages;	/* no. of maximum pages stored */
+	atomic64_t dup_data_size;	/* compressed size of pages duplicated */
+	atomic64_t meta_data_size;	/* size of zram_entries */
+	atomic64_t recomp_pages;	/* no. of pages in secondary algorithm */
+	atomic64_t recomp_saved;	/* bytes saved by recompression */
+	atomic64_t recomp_failed;	/* no. of recompressions without gain */
+	atomic64_t huge_pages;		/* no. of pages stored uncompressed */
+	atomic64_t incomp_skipped;	/* no. of compressions skipped */
+	atomic64_t incomp_verified;	/* no. of predictions checked */
+	atomic64_t incomp_mispredicted;	/* no. of checks that compressed */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	atomic64_t bd_count;		/* no. of pages in backing device */
+	atomic64_t bd_reads;		/* no. of reads from backing device */
+	atomic64_t bd_writes;		/* no. of writes to backing device */
+#endif
+};
+
+struct zram_hash {
+	spinlock_t lock;
+	struct rb_root rb_root;
 };
 
 struct zram_meta {
 	struct zram_table_entry *table;
 	struct zs_pool *mem_pool;
+	/* checksum indexed trees of zram_entry, used by deduplication */
+	struct zram_hash *hash;
+	size_t hash_size;
 };
 
 struct zram {
 	struct zram_meta *meta;
 	struct zcomp *comp;
+	/* secondary compressor used by recompress, NULL if not set up */
+	struct zcomp *recomp;
 	struct gendisk *disk;
 	/* Prevent concurrent execution of device init */
 	struct rw_semaphore init_lock;
@@ -110,6 +168,13 @@ struct zram {
 	 */
 	unsigned long limit_pages;
 	int max_comp_streams;
+	/* one compression stream per CPU instead of a shared stream list */
+	bool percpu_streams;
+	/* skip compression of pages that look incompressible */
+	bool incomp_predict;
+	/* zsmalloc compacts in the background above this fragmentation */
+	unsigned int compact_threshold;
+	atomic_t incomp_predicted;
 
 	struct zram_stats stats;
 	atomic_t refcount; /* refcount for zram_meta */
@@ -121,5 +186,31 @@ struct zram {
 	 */
 	u64 disksize;	/* bytes */
 	char compressor[10];
+	char recomp_algorithm[10];
+	/* deduplicate identical pages, can only be changed before init */
+	bool use_dedup;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned int old_block_size;
+	/* one bit per page of the backing device, set if the page is used */
+	unsigned long *bitmap;
+	unsigned long nr_pages;
+	spinlock_t bitmap_lock;
+#endif
+#ifdef CONFIG_ZRAM_MEMORY_TRACKING
+	struct dentry *debugfs_dir;
+#endif
 };
+
+static inline bool zram_dedup_enabled(struct zram *zram)
+{
+#ifdef CONFIG_ZRAM_DEDUP
+	return zram->use_dedup;
+#else
+	return false;
+#endif
+}
+
+void zram_entry_free(struct zram *zram, struct zram_entry *entry);
 #endif
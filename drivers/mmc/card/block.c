@@ -34,6 +34,8 @@
 #include <linux/delay.h>
 #include <linux/capability.h>
 #include <linux/compat.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <linux/mmc/ioctl.h>
 #include <linux/mmc/card.h>
@@ -59,6 +61,12 @@ MODULE_ALIAS("mmc:block");
 #define INAND_CMD38_ARG_SECTRIM1 0x81
 #define INAND_CMD38_ARG_SECTRIM2 0x88
 
+#define mmc_req_rel_wr(req)	(((req->cmd_flags & REQ_FUA) || \
+				  (req->cmd_flags & REQ_META)) && \
+				  (rq_data_dir(req) == WRITE))
+#define PACKED_CMD_VER	0x01
+#define PACKED_CMD_WR	0x02
+
 static DEFINE_MUTEX(block_mutex);
 
 /*
@@ -77,6 +85,41 @@ static int max_devices;
 static DECLARE_BITMAP(dev_use, 256);
 static DECLARE_BITMAP(name_use, 256);
 
+/*
+ * Why collecting requests for a packed write stopped.
+ */
+enum mmc_packed_stop {
+	MMC_PACKED_STOP_EMPTY = 0,	/* no more requests queued */
+	MMC_PACKED_STOP_MAX_NR,		/* max packed entries reached */
+	MMC_PACKED_STOP_SECTORS,	/* max transfer size reached */
+	MMC_PACKED_STOP_SEGMENTS,	/* max segments reached */
+	MMC_PACKED_STOP_READ,		/* next request is a read */
+	MMC_PACKED_STOP_FLUSH,		/* next request is a flush or discard */
+	MMC_PACKED_STOP_REL_WR,		/* next request is a legacy rel write */
+	MMC_PACKED_STOP_NR,
+};
+
+static const char *mmc_packed_stop_names[MMC_PACKED_STOP_NR] = {
+	[MMC_PACKED_STOP_EMPTY]		= "empty_queue",
+	[MMC_PACKED_STOP_MAX_NR]	= "max_entries",
+	[MMC_PACKED_STOP_SECTORS]	= "max_sectors",
+	[MMC_PACKED_STOP_SEGMENTS]	= "max_segments",
+	[MMC_PACKED_STOP_READ]		= "read",
+	[MMC_PACKED_STOP_FLUSH]		= "flush_discard",
+	[MMC_PACKED_STOP_REL_WR]	= "rel_write",
+};
+
+struct mmc_blk_packed_stats {
+	unsigned long	packed_cmds;	/* packed writes issued */
+	unsigned long	packed_reqs;	/* requests sent in packed writes */
+	unsigned long	nr_entries[MMC_PACKED_NR_MAX + 1];
+	unsigned long	stop[MMC_PACKED_STOP_NR];
+	unsigned long	retries;	/* packed writes resent */
+	unsigned long	partial;	/* resent from the failure index */
+	unsigned long	aborts;		/* packed writes failed */
+	unsigned long	reverts;	/* unpacked after an error */
+};
+
 /*
  * There is one mmc_blk_data per slot.
  */
@@ -89,6 +132,7 @@ struct mmc_blk_data {
 	unsigned int	flags;
 #define MMC_BLK_CMD23	(1 << 0)	/* Can do SET_BLOCK_COUNT for multiblock */
 #define MMC_BLK_REL_WR	(1 << 1)	/* MMC Reliable write support */
+#define MMC_BLK_PACKED_CMD	(1 << 2)	/* MMC packed command support */
 
 	unsigned int	usage;
 	unsigned int	read_only;
@@ -110,6 +154,11 @@ struct mmc_blk_data {
 	struct device_attribute power_ro_lock;
 	struct device_attribute power_ro_lock_legacy;
 	int	area_type;
+
+	struct mmc_blk_packed_stats packed_stats;
+#ifdef CONFIG_DEBUG_FS
+	struct dentry	*packed_dentry;
+#endif
 };
 
 static DEFINE_MUTEX(open_lock);
@@ -1398,6 +1447,363 @@ static int mmc_blk_cmd_err(struct mmc_blk_data *md, struct mmc_card *card,
 	return ret;
 }
 
+static inline void mmc_blk_clear_packed(struct mmc_queue_req *mqrq)
+{
+	struct mmc_packed *packed = mqrq->packed;
+
+	BUG_ON(!packed);
+
+	mqrq->cmd_type = MMC_PACKED_NONE;
+	packed->nr_entries = MMC_PACKED_NR_ZERO;
+	packed->idx_failure = MMC_PACKED_NR_IDX;
+	packed->retries = 0;
+	packed->blocks = 0;
+}
+
+/*
+ * Collect the writes queued behind @req into the packed list of the
+ * current request. Returns the number of packed entries, or 0 if @req
+ * is to be issued on its own.
+ */
+static u8 mmc_blk_prep_packed_list(struct mmc_queue *mq, struct request *req)
+{
+	struct request_queue *q = mq->queue;
+	struct mmc_card *card = mq->card;
+	struct request *next = NULL;
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_queue_req *mqrq = mq->mqrq_cur;
+	struct mmc_blk_packed_stats *stats = &md->packed_stats;
+	bool en_rel_wr = card->ext_csd.rel_param & EXT_CSD_WR_REL_PARAM_EN;
+	unsigned int req_sectors, phys_segments;
+	unsigned int max_blk_count, max_phys_segs;
+	enum mmc_packed_stop stop;
+	bool put_back = true;
+	u8 max_packed_rw;
+	u8 reqs = 0;
+
+	mqrq->cmd_type = MMC_PACKED_NONE;
+
+	if (!(md->flags & MMC_BLK_PACKED_CMD))
+		return 0;
+
+	if (rq_data_dir(req) != WRITE)
+		return 0;
+
+	/* Legacy reliable writes are split, they can't be packed */
+	if (mmc_req_rel_wr(req) && (md->flags & MMC_BLK_REL_WR) && !en_rel_wr)
+		return 0;
+
+	mmc_blk_clear_packed(mqrq);
+
+	max_packed_rw = min_t(u8, card->ext_csd.max_packed_writes,
+			      MMC_PACKED_NR_MAX);
+	max_blk_count = min(card->host->max_blk_count,
+			    card->host->max_req_size >> 9);
+	if (unlikely(max_blk_count > 0xffff))
+		max_blk_count = 0xffff;
+	max_phys_segs = queue_max_segments(q);
+
+	/* The packed header takes one block and one segment */
+	req_sectors = blk_rq_sectors(req) + 1;
+	phys_segments = req->nr_phys_segments + 1;
+
+	do {
+		if (reqs >= max_packed_rw - 1) {
+			stop = MMC_PACKED_STOP_MAX_NR;
+			put_back = false;
+			break;
+		}
+
+		spin_lock_irq(q->queue_lock);
+		next = blk_fetch_request(q);
+		spin_unlock_irq(q->queue_lock);
+		if (!next) {
+			stop = MMC_PACKED_STOP_EMPTY;
+			put_back = false;
+			break;
+		}
+
+		if (next->cmd_flags & (REQ_DISCARD | REQ_FLUSH)) {
+			stop = MMC_PACKED_STOP_FLUSH;
+			break;
+		}
+
+		if (rq_data_dir(next) != WRITE) {
+			stop = MMC_PACKED_STOP_READ;
+			break;
+		}
+
+		if (mmc_req_rel_wr(next) &&
+		    (md->flags & MMC_BLK_REL_WR) && !en_rel_wr) {
+			stop = MMC_PACKED_STOP_REL_WR;
+			break;
+		}
+
+		req_sectors += blk_rq_sectors(next);
+		if (req_sectors > max_blk_count) {
+			stop = MMC_PACKED_STOP_SECTORS;
+			break;
+		}
+
+		phys_segments += next->nr_phys_segments;
+		if (phys_segments > max_phys_segs) {
+			stop = MMC_PACKED_STOP_SEGMENTS;
+			break;
+		}
+
+		list_add_tail(&next->queuelist, &mqrq->packed->list);
+		reqs++;
+	} while (1);
+
+	if (put_back) {
+		spin_lock_irq(q->queue_lock);
+		blk_requeue_request(q, next);
+		spin_unlock_irq(q->queue_lock);
+	}
+
+	stats->stop[stop]++;
+
+	if (reqs > 0) {
+		list_add(&req->queuelist, &mqrq->packed->list);
+		mqrq->packed->nr_entries = ++reqs;
+		mqrq->packed->retries = reqs;
+		return reqs;
+	}
+
+	return 0;
+}
+
+static int mmc_blk_packed_err_check(struct mmc_card *card,
+				    struct mmc_async_req *areq)
+{
+	struct mmc_queue_req *mq_rq = container_of(areq, struct mmc_queue_req,
+						   mmc_active);
+	struct request *req = mq_rq->req;
+	struct mmc_packed *packed = mq_rq->packed;
+	int err, check;
+	u32 status;
+	u8 *ext_csd;
+
+	BUG_ON(!packed);
+
+	packed->retries--;
+	check = mmc_blk_err_check(card, areq);
+	err = get_card_status(card, &status, 0);
+	if (err) {
+		pr_err("%s: error %d sending status command\n",
+		       req->rq_disk->disk_name, err);
+		return MMC_BLK_ABORT;
+	}
+
+	if (!(status & R1_EXCEPTION_EVENT))
+		return check;
+
+	ext_csd = kzalloc(512, GFP_KERNEL);
+	if (!ext_csd) {
+		pr_err("%s: unable to allocate buffer for ext_csd\n",
+		       req->rq_disk->disk_name);
+		return MMC_BLK_ABORT;
+	}
+
+	err = mmc_send_ext_csd(card, ext_csd);
+	if (err) {
+		pr_err("%s: error %d sending ext_csd\n",
+		       req->rq_disk->disk_name, err);
+		check = MMC_BLK_ABORT;
+		goto free;
+	}
+
+	if ((ext_csd[EXT_CSD_EXP_EVENTS_STATUS] & EXT_CSD_PACKED_FAILURE) &&
+	    (ext_csd[EXT_CSD_PACKED_CMD_STATUS] &
+	     EXT_CSD_PACKED_GENERIC_ERROR)) {
+		/*
+		 * Without a failure index nothing is known to be written,
+		 * so resend the packed command from its first entry.
+		 */
+		if (ext_csd[EXT_CSD_PACKED_CMD_STATUS] &
+		    EXT_CSD_PACKED_INDEXED_ERROR)
+			packed->idx_failure =
+				ext_csd[EXT_CSD_PACKED_FAILURE_INDEX] - 1;
+		else
+			packed->idx_failure = 0;
+		check = MMC_BLK_PARTIAL;
+		pr_err("%s: packed cmd failed, nr %u, sectors %u, failure index: %d\n",
+		       req->rq_disk->disk_name, packed->nr_entries,
+		       packed->blocks, packed->idx_failure);
+	}
+free:
+	kfree(ext_csd);
+
+	return check;
+}
+
+static void mmc_blk_packed_hdr_wrq_prep(struct mmc_queue_req *mqrq,
+					struct mmc_card *card,
+					struct mmc_queue *mq)
+{
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	struct request *prq;
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_packed *packed = mqrq->packed;
+	bool do_rel_wr, do_data_tag;
+	__le32 *packed_cmd_hdr;
+	u8 i = 1;
+
+	BUG_ON(!packed);
+
+	mqrq->cmd_type = MMC_PACKED_WRITE;
+	packed->blocks = 0;
+	packed->idx_failure = MMC_PACKED_NR_IDX;
+
+	packed_cmd_hdr = packed->cmd_hdr;
+	memset(packed_cmd_hdr, 0, sizeof(packed->cmd_hdr));
+	packed_cmd_hdr[0] = cpu_to_le32((packed->nr_entries << 16) |
+					(PACKED_CMD_WR << 8) | PACKED_CMD_VER);
+
+	/*
+	 * Argument for each entry of packed group
+	 */
+	list_for_each_entry(prq, &packed->list, queuelist) {
+		do_rel_wr = mmc_req_rel_wr(prq) && (md->flags & MMC_BLK_REL_WR);
+		do_data_tag = (card->ext_csd.data_tag_unit_size) &&
+			(prq->cmd_flags & REQ_META) &&
+			(blk_rq_bytes(prq) >= card->ext_csd.data_tag_unit_size);
+		/* Argument of CMD23 */
+		packed_cmd_hdr[(i * 2)] = cpu_to_le32(blk_rq_sectors(prq) |
+			(do_rel_wr ? (1 << 31) : 0) |
+			(do_data_tag ? (1 << 29) : 0));
+		/* Argument of CMD25 */
+		packed_cmd_hdr[((i * 2)) + 1] = cpu_to_le32(
+			mmc_card_blockaddr(card) ?
+			blk_rq_pos(prq) : blk_rq_pos(prq) << 9);
+		packed->blocks += blk_rq_sectors(prq);
+		i++;
+	}
+
+	memset(brq, 0, sizeof(struct mmc_blk_request));
+	brq->mrq.cmd = &brq->cmd;
+	brq->mrq.data = &brq->data;
+	brq->mrq.sbc = &brq->sbc;
+	brq->mrq.stop = &brq->stop;
+
+	/* The packed header is sent as the first block of the transfer */
+	brq->sbc.opcode = MMC_SET_BLOCK_COUNT;
+	brq->sbc.arg = (1 << 30) | (packed->blocks + 1);
+	brq->sbc.flags = MMC_RSP_R1 | MMC_CMD_AC;
+
+	brq->cmd.opcode = MMC_WRITE_MULTIPLE_BLOCK;
+	brq->cmd.arg = blk_rq_pos(req);
+	if (!mmc_card_blockaddr(card))
+		brq->cmd.arg <<= 9;
+	brq->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+
+	brq->data.blksz = 512;
+	brq->data.blocks = packed->blocks + 1;
+	brq->data.flags |= MMC_DATA_WRITE;
+
+	brq->stop.opcode = MMC_STOP_TRANSMISSION;
+	brq->stop.arg = 0;
+	brq->stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+
+	mmc_set_data_timeout(&brq->data, card);
+
+	brq->data.sg = mqrq->sg;
+	brq->data.sg_len = mmc_queue_map_sg(mq, mqrq);
+
+	mqrq->mmc_active.mrq = &brq->mrq;
+	mqrq->mmc_active.err_check = mmc_blk_packed_err_check;
+}
+
+/*
+ * Complete the packed entries written before the failure index. If an
+ * entry failed, the packed command is resent from that entry on and 1
+ * is returned.
+ */
+static int mmc_blk_end_packed_req(struct mmc_blk_data *md,
+				  struct mmc_queue_req *mq_rq)
+{
+	struct mmc_packed *packed = mq_rq->packed;
+	struct request *prq;
+	int idx = packed->idx_failure, i = 0;
+
+	BUG_ON(!packed);
+
+	while (!list_empty(&packed->list)) {
+		prq = list_entry_rq(packed->list.next);
+		if (idx == i) {
+			/* retry from error index */
+			md->packed_stats.partial++;
+			packed->nr_entries -= idx;
+			mq_rq->req = prq;
+
+			if (packed->nr_entries == MMC_PACKED_NR_SINGLE) {
+				list_del_init(&prq->queuelist);
+				mmc_blk_clear_packed(mq_rq);
+			}
+			return 1;
+		}
+		list_del_init(&prq->queuelist);
+		spin_lock_irq(&md->lock);
+		__blk_end_request(prq, 0, blk_rq_bytes(prq));
+		spin_unlock_irq(&md->lock);
+		i++;
+	}
+
+	mmc_blk_clear_packed(mq_rq);
+	return 0;
+}
+
+static void mmc_blk_abort_packed_req(struct mmc_blk_data *md,
+				     struct mmc_queue_req *mq_rq)
+{
+	struct mmc_packed *packed = mq_rq->packed;
+	struct request *prq;
+
+	BUG_ON(!packed);
+
+	md->packed_stats.aborts++;
+	spin_lock_irq(&md->lock);
+	while (!list_empty(&packed->list)) {
+		prq = list_entry_rq(packed->list.next);
+		list_del_init(&prq->queuelist);
+		if (mmc_card_removed(md->queue.card))
+			prq->cmd_flags |= REQ_QUIET;
+		__blk_end_request(prq, -EIO, blk_rq_bytes(prq));
+	}
+	spin_unlock_irq(&md->lock);
+
+	mmc_blk_clear_packed(mq_rq);
+}
+
+/*
+ * Put all but the first packed entry back on the queue, the first
+ * one is then issued as a normal write.
+ */
+static void mmc_blk_revert_packed_req(struct mmc_queue *mq,
+				      struct mmc_queue_req *mq_rq)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_packed *packed = mq_rq->packed;
+	struct request *prq;
+	struct request_queue *q = mq->queue;
+
+	BUG_ON(!packed);
+
+	md->packed_stats.reverts++;
+	spin_lock_irq(q->queue_lock);
+	while (!list_empty(&packed->list)) {
+		prq = list_entry_rq(packed->list.prev);
+		list_del_init(&prq->queuelist);
+		/* requeue from the tail so the queue order is kept */
+		if (prq != mq_rq->req)
+			blk_requeue_request(q, prq);
+	}
+	spin_unlock_irq(q->queue_lock);
+
+	mmc_blk_clear_packed(mq_rq);
+}
+
 static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 {
 	struct mmc_blk_data *md = mq->data;
@@ -1408,13 +1814,26 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 	struct mmc_queue_req *mq_rq;
 	struct request *req;
 	struct mmc_async_req *areq;
+	u8 reqs = 0;
 
 	if (!rqc && !mq->mqrq_prev->req)
 		return 0;
 
+	if (rqc) {
+		reqs = mmc_blk_prep_packed_list(mq, rqc);
+		if (reqs >= 2) {
+			md->packed_stats.packed_cmds++;
+			md->packed_stats.packed_reqs += reqs;
+			md->packed_stats.nr_entries[reqs]++;
+		}
+	}
+
 	do {
 		if (rqc) {
-			mmc_blk_rw_rq_prep(mq->mqrq_cur, card, 0, mq);
+			if (reqs >= 2)
+				mmc_blk_packed_hdr_wrq_prep(mq->mqrq_cur, card, mq);
+			else
+				mmc_blk_rw_rq_prep(mq->mqrq_cur, card, 0, mq);
 			areq = &mq->mqrq_cur->mmc_active;
 		} else
 			areq = NULL;
@@ -1435,6 +1854,12 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 			 * A block was successfully transferred.
 			 */
 			mmc_blk_reset_success(md, type);
+
+			if (mmc_packed_cmd(mq_rq->cmd_type)) {
+				ret = mmc_blk_end_packed_req(md, mq_rq);
+				break;
+			}
+
 			spin_lock_irq(&md->lock);
 			ret = __blk_end_request(req, 0,
 						brq->data.bytes_xfered);
@@ -1453,7 +1878,11 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 			}
 			break;
 		case MMC_BLK_CMD_ERR:
-			ret = mmc_blk_cmd_err(md, card, brq, req, ret);
+			/* a packed write is resent as a whole */
+			if (mmc_packed_cmd(mq_rq->cmd_type))
+				ret = 1;
+			else
+				ret = mmc_blk_cmd_err(md, card, brq, req, ret);
 			if (mmc_blk_reset(md, card->host, type))
 				goto cmd_abort;
 			if (!ret)
@@ -1502,6 +1931,16 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 		}
 
 		if (ret) {
+			if (mmc_packed_cmd(mq_rq->cmd_type)) {
+				if (!mq_rq->packed->retries)
+					goto cmd_abort;
+				md->packed_stats.retries++;
+				mmc_blk_packed_hdr_wrq_prep(mq_rq, card, mq);
+				mmc_start_req(card->host, &mq_rq->mmc_active,
+					      NULL);
+				continue;
+			}
+
 			/*
 			 * In case of a incomplete request
 			 * prepare it again and resend.
@@ -1514,15 +1953,23 @@ static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
 	return 1;
 
  cmd_abort:
-	spin_lock_irq(&md->lock);
-	if (mmc_card_removed(card))
-		req->cmd_flags |= REQ_QUIET;
-	while (ret)
-		ret = __blk_end_request(req, -EIO, blk_rq_cur_bytes(req));
-	spin_unlock_irq(&md->lock);
+	if (mmc_packed_cmd(mq_rq->cmd_type)) {
+		mmc_blk_abort_packed_req(md, mq_rq);
+	} else {
+		spin_lock_irq(&md->lock);
+		if (mmc_card_removed(card))
+			req->cmd_flags |= REQ_QUIET;
+		while (ret)
+			ret = __blk_end_request(req, -EIO,
+						blk_rq_cur_bytes(req));
+		spin_unlock_irq(&md->lock);
+	}
 
  start_new_req:
 	if (rqc) {
+		/* after an error the current request is issued unpacked */
+		if (mmc_packed_cmd(mq->mqrq_cur->cmd_type))
+			mmc_blk_revert_packed_req(mq, mq->mqrq_cur);
 		mmc_blk_rw_rq_prep(mq->mqrq_cur, card, 0, mq);
 		mmc_start_req(card->host, &mq->mqrq_cur->mmc_active, NULL);
 	}
@@ -1584,6 +2031,90 @@ out:
 	return ret;
 }
 
+#ifdef CONFIG_DEBUG_FS
+static int mmc_blk_packed_stats_show(struct seq_file *s, void *data)
+{
+	struct mmc_blk_data *md = s->private;
+	struct mmc_blk_packed_stats *stats = &md->packed_stats;
+	int i;
+
+	seq_printf(s, "packed_cmds %lu\n", stats->packed_cmds);
+	seq_printf(s, "packed_reqs %lu\n", stats->packed_reqs);
+	seq_printf(s, "retries %lu\n", stats->retries);
+	seq_printf(s, "partial %lu\n", stats->partial);
+	seq_printf(s, "aborts %lu\n", stats->aborts);
+	seq_printf(s, "reverts %lu\n", stats->reverts);
+
+	seq_puts(s, "stop reasons:\n");
+	for (i = 0; i < MMC_PACKED_STOP_NR; i++)
+		seq_printf(s, "  %-14s %lu\n", mmc_packed_stop_names[i],
+			   stats->stop[i]);
+
+	seq_puts(s, "entries:\n");
+	for (i = 2; i <= MMC_PACKED_NR_MAX; i++)
+		if (stats->nr_entries[i])
+			seq_printf(s, "  %-3d %lu\n", i, stats->nr_entries[i]);
+
+	return 0;
+}
+
+static int mmc_blk_packed_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc_blk_packed_stats_show, inode->i_private);
+}
+
+static ssize_t mmc_blk_packed_stats_write(struct file *file,
+					  const char __user *ubuf,
+					  size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct mmc_blk_data *md = s->private;
+
+	/* any write resets the statistics */
+	memset(&md->packed_stats, 0, sizeof(md->packed_stats));
+
+	return count;
+}
+
+static const struct file_operations mmc_blk_packed_stats_fops = {
+	.open		= mmc_blk_packed_stats_open,
+	.read		= seq_read,
+	.write		= mmc_blk_packed_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void mmc_blk_packed_debugfs_init(struct mmc_blk_data *md,
+					struct mmc_card *card)
+{
+	if (!card->debugfs_root)
+		return;
+
+	md->packed_dentry = debugfs_create_file("packing_stats",
+				S_IRUSR | S_IWUSR, card->debugfs_root, md,
+				&mmc_blk_packed_stats_fops);
+}
+
+static void mmc_blk_packed_debugfs_exit(struct mmc_blk_data *md,
+					struct mmc_card *card)
+{
+	/* gone already if the card's debugfs directory was removed */
+	if (card->debugfs_root)
+		debugfs_remove(md->packed_dentry);
+	md->packed_dentry = NULL;
+}
+#else
+static inline void mmc_blk_packed_debugfs_init(struct mmc_blk_data *md,
+					       struct mmc_card *card)
+{
+}
+
+static inline void mmc_blk_packed_debugfs_exit(struct mmc_blk_data *md,
+					       struct mmc_card *card)
+{
+}
+#endif
+
 static inline int mmc_blk_readonly(struct mmc_card *card)
 {
 	return mmc_card_readonly(card) ||
@@ -1691,6 +2222,21 @@ static struct mmc_blk_data *mmc_blk_alloc_req(struct mmc_card *card,
 		blk_queue_flush(md->queue.queue, REQ_FLUSH | REQ_FUA);
 	}
 
+	/*
+	 * Packed writes need the failure event to recover from a partial
+	 * failure, and a 512 byte header, so 4KB sector cards are left out.
+	 */
+	if (mmc_card_mmc(card) &&
+	    md->area_type == MMC_BLK_DATA_AREA_MAIN &&
+	    md->flags & MMC_BLK_CMD23 &&
+	    card->ext_csd.packed_event_en &&
+	    card->ext_csd.data_sector_size == 512) {
+		if (!mmc_packed_init(&md->queue, card)) {
+			md->flags |= MMC_BLK_PACKED_CMD;
+			mmc_blk_packed_debugfs_init(md, card);
+		}
+	}
+
 	return md;
 
  err_putdisk:
@@ -1802,6 +2348,10 @@ static void mmc_blk_remove_req(struct mmc_blk_data *md)
 
 		/* Then flush out any already in there */
 		mmc_cleanup_queue(&md->queue);
+		if (md->flags & MMC_BLK_PACKED_CMD) {
+			mmc_blk_packed_debugfs_exit(md, card);
+			mmc_packed_clean(&md->queue);
+		}
 		mmc_blk_put(md);
 	}
 }
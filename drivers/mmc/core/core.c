@@ -41,6 +41,13 @@
 #include "sd_ops.h"
 #include "sdio_ops.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/mmc.h>
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(mmc_dma_map_ahead);
+EXPORT_TRACEPOINT_SYMBOL_GPL(mmc_dma_map);
+EXPORT_TRACEPOINT_SYMBOL_GPL(mmc_dma_unmap);
+
 static struct workqueue_struct *workqueue;
 static const unsigned freqs[] = { 400000, 300000, 200000, 100000 };
 
@@ -235,6 +242,8 @@ void mmc_request_done(struct mmc_host *host, struct mmc_request *mrq)
 	struct mmc_command *cmd = mrq->cmd;
 	int err = cmd->error;
 
+	mrq->done_time = ktime_get();
+
 	if (err && cmd->retries && mmc_host_is_spi(host)) {
 		if (cmd->resp[0] & R1_SPI_ILLEGAL_COMMAND)
 			cmd->retries = 0;
@@ -341,6 +350,8 @@ mmc_start_request(struct mmc_host *host, struct mmc_request *mrq)
 	}
 	mmc_host_clk_hold(host);
 	led_trigger_event(host->led, LED_FULL);
+	trace_mmc_request_start(host, mrq);
+	mrq->start_time = ktime_get();
 	host->ops->request(host, mrq);
 }
 
@@ -439,10 +450,13 @@ static void mmc_wait_for_req_done(struct mmc_host *host,
 static void mmc_pre_req(struct mmc_host *host, struct mmc_request *mrq,
 		 bool is_first_req)
 {
+	mrq->pre_time = ktime_get();
 	if (host->ops->pre_req) {
 		mmc_host_clk_hold(host);
 		host->ops->pre_req(host, mrq, is_first_req);
 		mmc_host_clk_release(host);
+		mrq->map_ns += ktime_to_ns(ktime_sub(ktime_get(),
+						     mrq->pre_time));
 	}
 }
 
@@ -458,13 +472,41 @@ static void mmc_pre_req(struct mmc_host *host, struct mmc_request *mrq,
 static void mmc_post_req(struct mmc_host *host, struct mmc_request *mrq,
 			 int err)
 {
+	ktime_t start;
+
 	if (host->ops->post_req) {
+		start = ktime_get();
 		mmc_host_clk_hold(host);
 		host->ops->post_req(host, mrq, err);
 		mmc_host_clk_release(host);
+		mrq->map_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
 	}
 }
 
+/*
+ * Split the time of a completed async request into DMA mapping, bus
+ * transfer and card busy time. Busy is the time spent in err_check,
+ * which polls the card status until a write has been programmed.
+ */
+static void mmc_account_req(struct mmc_host *host, struct mmc_request *mrq,
+			    s64 busy_us)
+{
+	s64 map_us, xfer_us, total_us;
+
+	/* never reached the host, e.g. the card was removed */
+	if (!mrq->data || !ktime_to_ns(mrq->start_time))
+		return;
+
+	map_us = div_s64(mrq->map_ns + mrq->host_map_ns, NSEC_PER_USEC);
+	xfer_us = ktime_us_delta(mrq->done_time, mrq->start_time) -
+		  div_s64(mrq->host_map_ns, NSEC_PER_USEC);
+	total_us = ktime_us_delta(ktime_get(), mrq->pre_time);
+
+	trace_mmc_request_done(host, mrq, map_us, xfer_us, busy_us, total_us);
+	mmc_latency_hist_add(host, mrq->data, map_us, max_t(s64, xfer_us, 0),
+			     busy_us, total_us);
+}
+
 /**
  *	mmc_start_req - start a non-blocking request
  *	@host: MMC host to start command
@@ -487,21 +529,28 @@ struct mmc_async_req *mmc_start_req(struct mmc_host *host,
 	int err = 0;
 	int start_err = 0;
 	struct mmc_async_req *data = host->areq;
+	s64 busy_us = 0;
 
 	/* Prepare a new request */
 	if (areq)
 		mmc_pre_req(host, areq->mrq, !host->areq);
 
 	if (host->areq) {
+		ktime_t busy_start;
+
 		mmc_wait_for_req_done(host, host->areq->mrq);
+		busy_start = ktime_get();
 		err = host->areq->err_check(host->card, host->areq);
+		busy_us = ktime_us_delta(ktime_get(), busy_start);
 	}
 
 	if (!err && areq)
 		start_err = __mmc_start_req(host, areq->mrq);
 
-	if (host->areq)
+	if (host->areq) {
 		mmc_post_req(host, host->areq->mrq, 0);
+		mmc_account_req(host, host->areq->mrq, busy_us);
+	}
 
 	 /* Cancel a prepared request if it was not started. */
 	if ((err || start_err) && areq)
@@ -74,6 +74,17 @@ void mmc_remove_host_debugfs(struct mmc_host *host);
 void mmc_add_card_debugfs(struct mmc_card *card);
 void mmc_remove_card_debugfs(struct mmc_card *card);
 
+#ifdef CONFIG_DEBUG_FS
+void mmc_latency_hist_add(struct mmc_host *host, struct mmc_data *data,
+			  s64 map_us, s64 xfer_us, s64 busy_us, s64 total_us);
+#else
+static inline void mmc_latency_hist_add(struct mmc_host *host,
+					struct mmc_data *data, s64 map_us,
+					s64 xfer_us, s64 busy_us, s64 total_us)
+{
+}
+#endif
+
 void stedma40_dump_state(void);
 #endif
 
@@ -14,6 +14,10 @@
 #include <linux/slab.h>
 #include <linux/stat.h>
 #include <linux/fault-inject.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+
+#include <asm/sizes.h>
 
 #include <linux/mmc/card.h>
 #include <linux/mmc/host.h>
@@ -185,6 +189,154 @@ static int mmc_clock_opt_set(void *data, u64 val)
 DEFINE_SIMPLE_ATTRIBUTE(mmc_clock_fops, mmc_clock_opt_get, mmc_clock_opt_set,
 	"%llu\n");
 
+/*
+ * Request latency histograms, by direction and transfer size. Each
+ * request is split into DMA mapping, bus transfer and card busy time,
+ * plus its total time. Slot i counts latencies below 64us << i, the
+ * last slot everything above.
+ */
+#define MMC_LAT_SIZES		5
+#define MMC_LAT_SLOTS		12
+
+enum {
+	MMC_LAT_MAP = 0,
+	MMC_LAT_XFER,
+	MMC_LAT_BUSY,
+	MMC_LAT_TOTAL,
+	MMC_LAT_PHASES,
+};
+
+static const char *mmc_lat_phase_str[MMC_LAT_PHASES] = {
+	"map", "xfer", "busy", "total",
+};
+
+static const char *mmc_lat_size_str[MMC_LAT_SIZES] = {
+	"<=4k", "<=16k", "<=64k", "<=256k", ">256k",
+};
+
+struct mmc_latency_bucket {
+	unsigned long	count;
+	u64		sum_us[MMC_LAT_PHASES];
+	unsigned int	slot[MMC_LAT_PHASES][MMC_LAT_SLOTS];
+};
+
+struct mmc_latency_hist {
+	spinlock_t			lock;
+	struct mmc_latency_bucket	bucket[2][MMC_LAT_SIZES];
+};
+
+static int mmc_lat_size_idx(unsigned int bytes)
+{
+	if (bytes <= SZ_4K)
+		return 0;
+	if (bytes <= SZ_16K)
+		return 1;
+	if (bytes <= SZ_64K)
+		return 2;
+	if (bytes <= SZ_256K)
+		return 3;
+	return 4;
+}
+
+static int mmc_lat_slot(s64 us)
+{
+	if (us < 64)
+		return 0;
+	return min_t(int, fls((u32)min_t(s64, us >> 6, UINT_MAX)),
+		     MMC_LAT_SLOTS - 1);
+}
+
+void mmc_latency_hist_add(struct mmc_host *host, struct mmc_data *data,
+			  s64 map_us, s64 xfer_us, s64 busy_us, s64 total_us)
+{
+	struct mmc_latency_hist *hist = host->latency_hist;
+	struct mmc_latency_bucket *b;
+	s64 us[MMC_LAT_PHASES] = { map_us, xfer_us, busy_us, total_us };
+	unsigned long flags;
+	int i;
+
+	if (!hist)
+		return;
+
+	b = &hist->bucket[!!(data->flags & MMC_DATA_WRITE)]
+			 [mmc_lat_size_idx(data->blocks * data->blksz)];
+
+	spin_lock_irqsave(&hist->lock, flags);
+	b->count++;
+	for (i = 0; i < MMC_LAT_PHASES; i++) {
+		b->sum_us[i] += us[i];
+		b->slot[i][mmc_lat_slot(us[i])]++;
+	}
+	spin_unlock_irqrestore(&hist->lock, flags);
+}
+
+static int mmc_latency_show(struct seq_file *s, void *data)
+{
+	struct mmc_host *host = s->private;
+	struct mmc_latency_hist *hist = host->latency_hist;
+	struct mmc_latency_bucket *b;
+	int dir, size, i, j;
+
+	spin_lock_irq(&hist->lock);
+
+	seq_printf(s, "%-5s %-6s %-5s %10s %10s", "dir", "size", "phase",
+		   "count", "avg_us");
+	for (j = 0; j < MMC_LAT_SLOTS - 1; j++)
+		seq_printf(s, " %8u", 64 << j);
+	seq_printf(s, " %8s\n", "more");
+
+	for (dir = 0; dir < 2; dir++) {
+		for (size = 0; size < MMC_LAT_SIZES; size++) {
+			b = &hist->bucket[dir][size];
+			if (!b->count)
+				continue;
+
+			for (i = 0; i < MMC_LAT_PHASES; i++) {
+				seq_printf(s, "%-5s %-6s %-5s %10lu %10llu",
+					   dir ? "write" : "read",
+					   mmc_lat_size_str[size],
+					   mmc_lat_phase_str[i], b->count,
+					   div64_u64(b->sum_us[i], b->count));
+				for (j = 0; j < MMC_LAT_SLOTS; j++)
+					seq_printf(s, " %8u", b->slot[i][j]);
+				seq_putc(s, '\n');
+			}
+		}
+	}
+
+	spin_unlock_irq(&hist->lock);
+
+	return 0;
+}
+
+static int mmc_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc_latency_show, inode->i_private);
+}
+
+static ssize_t mmc_latency_write(struct file *file, const char __user *ubuf,
+				 size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct mmc_host *host = s->private;
+	struct mmc_latency_hist *hist = host->latency_hist;
+
+	/* any write resets the histograms */
+	spin_lock_irq(&hist->lock);
+	memset(hist->bucket, 0, sizeof(hist->bucket));
+	spin_unlock_irq(&hist->lock);
+
+	return count;
+}
+
+static const struct file_operations mmc_latency_fops = {
+	.open		= mmc_latency_open,
+	.read		= seq_read,
+	.write		= mmc_latency_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 void mmc_add_host_debugfs(struct mmc_host *host)
 {
 	struct dentry *root;
@@ -207,6 +359,15 @@ void mmc_add_host_debugfs(struct mmc_host *host)
 			&mmc_clock_fops))
 		goto err_node;
 
+	host->latency_hist = kzalloc(sizeof(struct mmc_latency_hist),
+				     GFP_KERNEL);
+	if (host->latency_hist) {
+		spin_lock_init(&host->latency_hist->lock);
+		if (!debugfs_create_file("latency_hist", S_IRUSR | S_IWUSR,
+					 root, host, &mmc_latency_fops))
+			goto err_node;
+	}
+
 #ifdef CONFIG_MMC_CLKGATE
 	if (!debugfs_create_u32("clk_delay", (S_IRUSR | S_IWUSR),
 				root, &host->clk_delay))
@@ -226,6 +387,8 @@ void mmc_add_host_debugfs(struct mmc_host *host)
 err_node:
 	debugfs_remove_recursive(root);
 	host->debugfs_root = NULL;
+	kfree(host->latency_hist);
+	host->latency_hist = NULL;
 err_root:
 	dev_err(&host->class_dev, "failed to initialize debugfs\n");
 }
@@ -233,6 +396,8 @@ err_root:
 void mmc_remove_host_debugfs(struct mmc_host *host)
 {
 	debugfs_remove_recursive(host->debugfs_root);
+	kfree(host->latency_hist);
+	host->latency_hist = NULL;
 }
 
 static int mmc_dbg_card_status_get(void *data, u64 *val)
@@ -360,4 +525,5 @@ err:
 void mmc_remove_card_debugfs(struct mmc_card *card)
 {
 	debugfs_remove_recursive(card->debugfs_root);
+	card->debugfs_root = NULL;
 }
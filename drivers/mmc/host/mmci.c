@@ -31,6 +31,9 @@
 #include <linux/dma-mapping.h>
 #include <linux/amba/mmci.h>
 #include <linux/pm_runtime.h>
+#include <linux/ktime.h>
+
+#include <trace/events/mmc.h>
 
 #include <asm/div64.h>
 #include <asm/io.h>
@@ -573,8 +576,15 @@ static void mmci_dma_finalize(struct mmci_host *host, struct mmc_data *data)
 		mmci_dma_data_error(host, data);
 	}
 
-	if (!data->host_cookie)
+	if (!data->host_cookie) {
+		ktime_t start = ktime_get();
+		s64 ns;
+
 		mmci_dma_unmap(host, data);
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		data->mrq->host_map_ns += ns;
+		trace_mmc_dma_unmap(host->mmc, data, ns);
+	}
 
 	/*
 	 * Use of DMA with scatter-gather is impossible.
@@ -652,20 +662,39 @@ static int __mmci_dma_prep_data(struct mmci_host *host, struct mmc_data *data,
 static int inline mmci_dma_prep_data(struct mmci_host *host,
 				     struct mmc_data *data)
 {
+	ktime_t start;
+	s64 ns;
+	int ret;
+
 	/* Check if next job is already prepared. */
 	if (host->dma_current && host->dma_desc_current)
 		return 0;
 
 	/* No job were prepared thus do it now. */
-	return __mmci_dma_prep_data(host, data, &host->dma_current,
-				    &host->dma_desc_current);
+	start = ktime_get();
+	ret = __mmci_dma_prep_data(host, data, &host->dma_current,
+				   &host->dma_desc_current);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	data->mrq->host_map_ns += ns;
+	if (!ret)
+		trace_mmc_dma_map(host->mmc, data, ns);
+
+	return ret;
 }
 
 static inline int mmci_dma_prep_next(struct mmci_host *host,
 				     struct mmc_data *data)
 {
 	struct mmci_host_next *nd = &host->next_data;
-	return __mmci_dma_prep_data(host, data, &nd->dma_chan, &nd->dma_desc);
+	ktime_t start = ktime_get();
+	int ret;
+
+	ret = __mmci_dma_prep_data(host, data, &nd->dma_chan, &nd->dma_desc);
+	if (!ret)
+		trace_mmc_dma_map_ahead(host->mmc, data,
+				ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	return ret;
 }
 
 static int mmci_dma_start_data(struct mmci_host *host)
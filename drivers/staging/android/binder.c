@@ -22,6 +22,7 @@
 #include <linux/file.h>
 #include <linux/freezer.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -41,7 +42,27 @@
 #include "binder.h"
 #include "binder_trace.h"
 
+/*
+ * binder_main_lock is still the big driver lock. Only the buffer
+ * allocator and the proc list have been taken out from under it:
+ *
+ * binder_procs_lock  - the binder_procs list
+ * proc->alloc_lock   - a proc's buffer allocator, see struct binder_proc
+ * binder_main_lock   - everything else: nodes, refs, threads, todo lists,
+ *                      transaction stacks and death notifications
+ *
+ * The payload of a large transaction is copied in with only the target's
+ * alloc_lock held. Everything else, including every ioctl, is serialized
+ * by binder_main_lock. There are no per-proc inner/outer locks, no
+ * per-node locks and node and ref counts are not atomic, so independent
+ * transactions do not run concurrently. Replacing binder_main_lock that
+ * way is a separate piece of work. The binder_lock_wait tracepoint shows
+ * how long contended acquisitions of binder_main_lock and alloc_lock wait.
+ *
+ * Lock order: binder_main_lock -> binder_procs_lock -> proc->alloc_lock
+ */
 static DEFINE_MUTEX(binder_main_lock);
+static DEFINE_MUTEX(binder_procs_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 static DEFINE_MUTEX(binder_mmap_lock);
 
@@ -85,6 +106,12 @@ BINDER_DEBUG_ENTRY(proc);
 
 #define BINDER_SMALL_BUF_SIZE (PAGE_SIZE * 64)
 
+/* transactions at least this big are copied without binder_main_lock */
+#define BINDER_UNLOCKED_COPY_MIN            SZ_1K
+
+/* buffer space async transactions always leave to synchronous ones */
+#define BINDER_SYNC_RESERVE(proc)           ((proc)->buffer_size / 4)
+
 enum {
 	BINDER_DEBUG_USER_ERROR             = 1U << 0,
 	BINDER_DEBUG_FAILED_TRANSACTION     = 1U << 1,
@@ -113,6 +140,11 @@ module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 static char *binder_devices_param = CONFIG_ANDROID_BINDER_DEVICES;
 module_param_named(devices, binder_devices_param, charp, S_IRUGO);
 
+/* freed buffer pages each proc keeps mapped for reuse */
+static uint binder_page_cache_max = 8;
+module_param_named(page_cache_max, binder_page_cache_max, uint,
+		   S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -165,22 +197,22 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_REPLY_SG) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_REPLY_SG) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -242,6 +274,23 @@ struct binder_work {
 	} type;
 };
 
+enum binder_latency_type {
+	BINDER_LATENCY_QUEUE,	/* queued until a target thread picks it up */
+	BINDER_LATENCY_PROCESS,	/* picked up until the reply is sent */
+	BINDER_LATENCY_REPLY,	/* reply sent until the caller picks it up */
+	BINDER_LATENCY_COUNT
+};
+
+/*
+ * Bucket 0 counts samples below 8us, bucket n > 0 those from 4 << n up
+ * to 8 << n us. The last bucket is open ended.
+ */
+#define BINDER_LATENCY_BUCKETS 16
+
+struct binder_latency {
+	u32 hist[BINDER_LATENCY_COUNT][BINDER_LATENCY_BUCKETS];
+};
+
 struct binder_node {
 	int debug_id;
 	struct binder_work work;
@@ -264,6 +313,7 @@ struct binder_node {
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
 	struct list_head async_todo;
+	struct binder_latency latency;
 };
 
 struct binder_ref_death {
@@ -306,6 +356,16 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+/*
+ * A thread's scheduling class: prio is the RT priority for SCHED_FIFO
+ * and SCHED_RR, the nice value for all other policies.
+ */
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;
+	bool reset_on_fork;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -328,23 +388,42 @@ struct binder_proc {
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
+	/*
+	 * The buffer allocator has its own lock so that buffers can be
+	 * allocated and filled without holding binder_main_lock.
+	 */
+	struct mutex alloc_lock;
 	struct list_head buffers;
 	struct rb_root free_buffers;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
+	size_t free_space;
 
 	struct page **pages;
+	struct list_head *page_lru;
+	struct list_head lru_pages;
+	size_t lru_count;
 	size_t buffer_size;
 	uint32_t buffer_free;
+	/*
+	 * Senders copying into this proc's buffers pin it with tmp_ref.
+	 * A released proc is only freed once the last of them is done.
+	 */
+	int tmp_ref;
+	bool is_dead;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	struct binder_latency latency;
+	/* transactions queued on the proc and its threads' todo lists */
+	int todo_depth;
+	int max_todo_depth;
 	struct list_head delivered_death;
 	int max_threads;
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	struct binder_priority default_priority;
 	struct dentry *debugfs_entry;
 	struct binder_context *context;
 };
@@ -387,9 +466,11 @@ struct binder_transaction {
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	queue_time;
+	ktime_t	deliver_time;
 };
 
 static void
@@ -532,10 +613,24 @@ out_unlock:
 	return -EBADF;
 }
 
+static void binder_mutex_lock(struct mutex *lock, const char *name,
+			      const char *tag)
+{
+	ktime_t start;
+
+	if (mutex_trylock(lock))
+		return;
+
+	start = ktime_get();
+	mutex_lock(lock);
+	trace_binder_lock_wait(name, tag,
+			       ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
 static inline void binder_lock(const char *tag)
 {
 	trace_binder_lock(tag);
-	mutex_lock(&binder_main_lock);
+	binder_mutex_lock(&binder_main_lock, "main", tag);
 	trace_binder_locked(tag);
 }
 
@@ -545,6 +640,17 @@ static inline void binder_unlock(const char *tag)
 	mutex_unlock(&binder_main_lock);
 }
 
+static inline void binder_alloc_lock(struct binder_proc *proc,
+				     const char *tag)
+{
+	binder_mutex_lock(&proc->alloc_lock, "alloc", tag);
+}
+
+static inline void binder_alloc_unlock(struct binder_proc *proc)
+{
+	mutex_unlock(&proc->alloc_lock);
+}
+
 static void binder_set_nice(long nice)
 {
 	long min_nice;
@@ -562,6 +668,136 @@ static void binder_set_nice(long nice)
 	binder_user_error("%d RLIMIT_NICE not set\n", current->pid);
 }
 
+static bool binder_is_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static struct binder_priority binder_get_priority(struct task_struct *task)
+{
+	struct binder_priority p;
+
+	p.sched_policy = task->policy;
+	p.reset_on_fork = task->sched_reset_on_fork;
+	if (binder_is_rt_policy(p.sched_policy))
+		p.prio = task->rt_priority;
+	else
+		p.prio = task_nice(task);
+	return p;
+}
+
+/*
+ * Switch the current thread to the scheduling class in @desired. Without
+ * CAP_SYS_NICE an RT priority above RLIMIT_RTPRIO falls back to the
+ * best nice value allowed, just like binder_set_nice() caps nice values.
+ */
+static void binder_set_priority(struct binder_priority desired)
+{
+	struct binder_priority cur = binder_get_priority(current);
+	struct sched_param param = { .sched_priority = 0 };
+	unsigned int policy;
+
+	if (binder_is_rt_policy(desired.sched_policy) &&
+	    !has_capability_noaudit(current, CAP_SYS_NICE) &&
+	    desired.prio > rlimit(RLIMIT_RTPRIO)) {
+		binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+			     "%d: RLIMIT_RTPRIO %lu below %d, using SCHED_NORMAL\n",
+			     current->pid, rlimit(RLIMIT_RTPRIO),
+			     desired.prio);
+		desired.sched_policy = SCHED_NORMAL;
+		desired.prio = -20;
+	}
+
+	if (cur.sched_policy == desired.sched_policy &&
+	    cur.prio == desired.prio &&
+	    cur.reset_on_fork == desired.reset_on_fork)
+		return;
+
+	trace_binder_set_priority(current->pid, cur.sched_policy, cur.prio,
+				  desired.sched_policy, desired.prio);
+
+	policy = desired.sched_policy;
+	if (desired.reset_on_fork)
+		policy |= SCHED_RESET_ON_FORK;
+
+	if (binder_is_rt_policy(desired.sched_policy)) {
+		param.sched_priority = desired.prio;
+		sched_setscheduler_nocheck(current, policy, &param);
+		return;
+	}
+	if (cur.sched_policy != desired.sched_policy ||
+	    cur.reset_on_fork != desired.reset_on_fork)
+		sched_setscheduler_nocheck(current, policy, &param);
+	binder_set_nice(desired.prio);
+}
+
+/*
+ * Pick the scheduling class the current thread handles @t in. A
+ * synchronous caller lends its own class, including RT, for as long as
+ * the transaction runs; the node's min_priority is a floor for nice
+ * values. Oneway transactions only get the node's floor.
+ */
+static void binder_transaction_priority(struct binder_transaction *t,
+					struct binder_node *node)
+{
+	struct binder_priority desired;
+
+	t->saved_priority = binder_get_priority(current);
+
+	if (!(t->flags & TF_ONE_WAY) &&
+	    binder_is_rt_policy(t->priority.sched_policy)) {
+		/* a lent RT class must not leak into children */
+		desired = t->priority;
+		desired.reset_on_fork = true;
+	} else if (binder_is_rt_policy(t->saved_priority.sched_policy)) {
+		/* never demote a thread that runs RT on its own */
+		return;
+	} else if (!(t->flags & TF_ONE_WAY) &&
+		   t->priority.prio < node->min_priority) {
+		desired = t->priority;
+		desired.reset_on_fork = t->saved_priority.reset_on_fork;
+	} else if (!(t->flags & TF_ONE_WAY) ||
+		   t->saved_priority.prio > node->min_priority) {
+		desired = t->saved_priority;
+		desired.prio = node->min_priority;
+	} else {
+		return;
+	}
+	binder_set_priority(desired);
+}
+
+/*
+ * Account one latency sample of @t, measured from @start until @now,
+ * to @proc and, for the types kept per node, to @node. Called with
+ * binder_main_lock held.
+ */
+static void binder_latency_add(struct binder_proc *proc,
+			       struct binder_node *node,
+			       struct binder_transaction *t,
+			       enum binder_latency_type type,
+			       ktime_t start, ktime_t now)
+{
+	s64 us = ktime_us_delta(now, start);
+	int bucket = 0;
+
+	if (us < 0)
+		us = 0;
+	trace_binder_transaction_latency(t, type, us);
+	if (us >= 8)
+		bucket = min_t(int, fls64(us >> 3), BINDER_LATENCY_BUCKETS - 1);
+	proc->latency.hist[type][bucket]++;
+	if (node)
+		node->latency.hist[type][bucket]++;
+}
+
+static void binder_todo_depth_inc(struct binder_proc *proc)
+{
+	proc->todo_depth++;
+	if (proc->todo_depth > proc->max_todo_depth)
+		proc->max_todo_depth = proc->todo_depth;
+	trace_binder_todo_depth(proc, proc->todo_depth);
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -633,13 +869,15 @@ static void binder_insert_allocated_buffer(struct binder_proc *proc,
 static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 						  uintptr_t user_ptr)
 {
-	struct rb_node *n = proc->allocated_buffers.rb_node;
-	struct binder_buffer *buffer;
+	struct rb_node *n;
+	struct binder_buffer *buffer = NULL;
 	struct binder_buffer *kern_ptr;
 
 	kern_ptr = (struct binder_buffer *)(user_ptr - proc->user_buffer_offset
 		- offsetof(struct binder_buffer, data));
 
+	binder_alloc_lock(proc, __func__);
+	n = proc->allocated_buffers.rb_node;
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(buffer->free);
@@ -649,20 +887,110 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 		else if (kern_ptr > buffer)
 			n = n->rb_right;
 		else
-			return buffer;
+			break;
 	}
-	return NULL;
+	binder_alloc_unlock(proc);
+	return n ? buffer : NULL;
 }
 
+/*
+ * Pages are only taken away from the user mapping with mmap_sem held for
+ * writing, so that binder_vm_fault() can't map a page that is being
+ * freed. Returns the vma to zap pages from, if there is one.
+ */
+static struct vm_area_struct *binder_lock_user_vma(struct binder_proc *proc,
+						   struct mm_struct **mmp)
+{
+	struct vm_area_struct *vma = NULL;
+	struct mm_struct *mm;
+
+	mm = get_task_mm(proc->tsk);
+	if (mm) {
+		down_write(&mm->mmap_sem);
+		vma = proc->vma;
+		if (vma && mm != proc->vma_vm_mm) {
+			pr_err("%d: vma mm and task mm mismatch\n",
+				proc->pid);
+			vma = NULL;
+		}
+	}
+	*mmp = mm;
+	return vma;
+}
+
+static void binder_unlock_user_vma(struct mm_struct *mm)
+{
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+}
+
+/*
+ * Really free the oldest cached pages until no more than @keep are left.
+ * A non-NULL @vma means the caller already holds its mmap_sem for writing.
+ */
+static void binder_shrink_page_cache(struct binder_proc *proc, size_t keep,
+				     struct vm_area_struct *vma)
+{
+	struct mm_struct *mm = NULL;
+
+	if (proc->lru_count <= keep)
+		return;
+
+	if (!vma)
+		vma = binder_lock_user_vma(proc, &mm);
+
+	while (proc->lru_count > keep) {
+		struct list_head *lru = proc->lru_pages.next;
+		size_t index = lru - proc->page_lru;
+		void *page_addr = proc->buffer + index * PAGE_SIZE;
+
+		list_del_init(lru);
+		proc->lru_count--;
+		if (vma)
+			zap_page_range(vma, (uintptr_t)page_addr +
+				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		__free_page(proc->pages[index]);
+		proc->pages[index] = NULL;
+	}
+
+	binder_unlock_user_vma(mm);
+}
+
+static int binder_map_pages(struct binder_proc *proc, void *start, void *end)
+{
+	struct vm_struct tmp_area;
+	struct page **page_array_ptr;
+
+	page_array_ptr = &proc->pages[(start - proc->buffer) / PAGE_SIZE];
+	tmp_area.addr = start;
+	tmp_area.size = end - start + PAGE_SIZE /* guard page? */;
+	if (map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr)) {
+		pr_err("%d: binder_alloc_buf failed to map pages %pK-%pK in kernel\n",
+		       proc->pid, start, end);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Pages are only mapped into the kernel here, userspace faults them in
+ * through binder_vm_fault() when it first reads them. Freed pages stay
+ * mapped on a per-proc LRU so that the next buffer can reuse them, up
+ * to binder_page_cache_max of them.
+ *
+ * binder_mmap() passes in the vma it is setting up, with mmap_sem already
+ * held for writing; everyone else passes NULL.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
 {
 	void *page_addr;
-	unsigned long user_page_addr;
-	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
+	void *run_start = NULL;
+	size_t index;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "%d: %s pages %pK-%pK\n", proc->pid,
@@ -673,95 +1001,90 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 
 	trace_binder_update_page_range(proc, allocate, start, end);
 
-	if (vma)
-		mm = NULL;
-	else
-		mm = get_task_mm(proc->tsk);
-
-	if (mm) {
-		down_write(&mm->mmap_sem);
-		vma = proc->vma;
-		if (vma && mm != proc->vma_vm_mm) {
-			pr_err("%d: vma mm and task mm mismatch\n",
-				proc->pid);
-			vma = NULL;
-		}
-	}
-
 	if (allocate == 0)
 		goto free_range;
 
-	if (vma == NULL) {
-		pr_err("%d: binder_alloc_buf failed to map pages in userspace, no vma\n",
-			proc->pid);
-		goto err_no_vma;
-	}
-
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
-		int ret;
-		struct page **page_array_ptr;
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		struct page **page;
+
+		index = (page_addr - proc->buffer) / PAGE_SIZE;
+		page = &proc->pages[index];
+		if (*page) {
+			/* cached, still mapped from its last use */
+			if (run_start &&
+			    binder_map_pages(proc, run_start, page_addr))
+				goto err_map_kernel_failed;
+			run_start = NULL;
+			BUG_ON(list_empty(&proc->page_lru[index]));
+			list_del_init(&proc->page_lru[index]);
+			proc->lru_count--;
+			continue;
+		}
 
-		BUG_ON(*page);
 		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
 		if (*page == NULL) {
 			pr_err("%d: binder_alloc_buf failed for page at %pK\n",
 				proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
-		tmp_area.addr = page_addr;
-		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
-		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
-		if (ret) {
-			pr_err("%d: binder_alloc_buf failed to map page at %pK in kernel\n",
-			       proc->pid, page_addr);
-			goto err_map_kernel_failed;
-		}
-		user_page_addr =
-			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
-		if (ret) {
-			pr_err("%d: binder_alloc_buf failed to map page at %lx in userspace\n",
-			       proc->pid, user_page_addr);
-			goto err_vm_insert_page_failed;
-		}
-		/* vm_insert_page does not seem to increment the refcount */
-	}
-	if (mm) {
-		up_write(&mm->mmap_sem);
-		mmput(mm);
+		if (!run_start)
+			run_start = page_addr;
 	}
+	if (run_start && binder_map_pages(proc, run_start, end))
+		goto err_map_kernel_failed;
 	return 0;
 
 free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
-err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		index = (page_addr - proc->buffer) / PAGE_SIZE;
+		BUG_ON(!proc->pages[index]);
+		list_add_tail(&proc->page_lru[index], &proc->lru_pages);
+		proc->lru_count++;
+	}
+	binder_shrink_page_cache(proc, binder_page_cache_max, vma);
+	return 0;
+
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
 err_alloc_page_failed:
-		;
-	}
-err_no_vma:
-	if (mm) {
-		up_write(&mm->mmap_sem);
-		mmput(mm);
+	/*
+	 * Drop the run that never got mapped, cache the pages before it.
+	 * Userspace may have faulted pages of the run in already.
+	 */
+	if (run_start) {
+		struct mm_struct *mm = NULL;
+
+		/*
+		 * Nothing can have been faulted in yet while binder_mmap()
+		 * still holds mmap_sem, so there is nothing to zap then.
+		 */
+		if (!vma) {
+			struct vm_area_struct *user_vma;
+
+			user_vma = binder_lock_user_vma(proc, &mm);
+			if (user_vma)
+				zap_page_range(user_vma, (uintptr_t)run_start +
+					proc->user_buffer_offset,
+					page_addr - run_start, NULL);
+		}
+		unmap_kernel_range((unsigned long)run_start,
+				   page_addr - run_start);
+		for (; page_addr > run_start; page_addr -= PAGE_SIZE) {
+			index = (page_addr - PAGE_SIZE - proc->buffer) /
+				PAGE_SIZE;
+			__free_page(proc->pages[index]);
+			proc->pages[index] = NULL;
+		}
+		binder_unlock_user_vma(mm);
 	}
+	binder_update_page_range(proc, 0, start, page_addr, vma);
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size,
-					      size_t extra_buffers_size,
-					      int is_async)
+static struct binder_buffer *binder_alloc_buf_locked(struct binder_proc *proc,
+						     size_t data_size,
+						     size_t offsets_size,
+						     size_t extra_buffers_size,
+						     int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -791,8 +1114,15 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 				  proc->pid, extra_buffers_size);
 		return NULL;
 	}
+	/*
+	 * Async transactions may use at most half of the buffer space and
+	 * never the last BINDER_SYNC_RESERVE of it, so a flood of oneway
+	 * calls cannot starve callers that are waiting for a reply.
+	 */
 	if (is_async &&
-	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
+	    (proc->free_async_space < size + sizeof(struct binder_buffer) ||
+	     proc->free_space < size + sizeof(struct binder_buffer) +
+				BINDER_SYNC_RESERVE(proc))) {
 		binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 			     "%d: binder_alloc_buf size %zd failed, no async space left\n",
 			      proc->pid, size);
@@ -860,6 +1190,11 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	buffer->offsets_size = offsets_size;
 	buffer->extra_buffers_size = extra_buffers_size;
 	buffer->async_transaction = is_async;
+	/* may be filled before binder_main_lock is taken, keep it private */
+	buffer->allow_user_free = 0;
+	buffer->transaction = NULL;
+	buffer->target_node = NULL;
+	proc->free_space -= size + sizeof(struct binder_buffer);
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
 		binder_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
@@ -870,6 +1205,21 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size,
+					      size_t extra_buffers_size,
+					      int is_async)
+{
+	struct binder_buffer *buffer;
+
+	binder_alloc_lock(proc, __func__);
+	buffer = binder_alloc_buf_locked(proc, data_size, offsets_size,
+					 extra_buffers_size, is_async);
+	binder_alloc_unlock(proc);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -925,8 +1275,8 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void binder_free_buf_locked(struct binder_proc *proc,
+				   struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
@@ -946,6 +1296,7 @@ static void binder_free_buf(struct binder_proc *proc,
 	BUG_ON((void *)buffer < proc->buffer);
 	BUG_ON((void *)buffer > proc->buffer + proc->buffer_size);
 
+	proc->free_space += size + sizeof(struct binder_buffer);
 	if (buffer->async_transaction) {
 		proc->free_async_space += size + sizeof(struct binder_buffer);
 
@@ -980,6 +1331,82 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	binder_alloc_lock(proc, __func__);
+	binder_free_buf_locked(proc, buffer);
+	binder_alloc_unlock(proc);
+}
+
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
+
+	BUG_ON(proc->tmp_ref);
+
+	buffers = 0;
+	while ((n = rb_first(&proc->allocated_buffers))) {
+		struct binder_buffer *buffer;
+
+		buffer = rb_entry(n, struct binder_buffer, rb_node);
+
+		t = buffer->transaction;
+		if (t) {
+			t->buffer = NULL;
+			buffer->transaction = NULL;
+			pr_err("release proc %d, transaction %d, not freed\n",
+			       proc->pid, t->debug_id);
+			/*BUG();*/
+		}
+
+		binder_free_buf(proc, buffer);
+		buffers++;
+	}
+
+	binder_stats_deleted(BINDER_STAT_PROC);
+
+	page_count = 0;
+	if (proc->pages) {
+		int i;
+
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			void *page_addr;
+
+			if (!proc->pages[i])
+				continue;
+
+			page_addr = proc->buffer + i * PAGE_SIZE;
+			binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+				     "%s: %d: page %d at %pK not freed\n",
+				     __func__, proc->pid, i, page_addr);
+			unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+			__free_page(proc->pages[i]);
+			page_count++;
+		}
+		kfree(proc->pages);
+		kfree(proc->page_lru);
+		vfree(proc->buffer);
+	}
+
+	put_task_struct(proc->tsk);
+
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "%s: %d buffers %d, pages %d\n",
+		     __func__, proc->pid, buffers, page_count);
+
+	kfree(proc);
+}
+
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	proc->tmp_ref--;
+	if (proc->is_dead && !proc->tmp_ref)
+		binder_free_proc(proc);
+}
+
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   binder_uintptr_t ptr)
 {
@@ -1903,12 +2330,16 @@ static int binder_fixup_parent(struct binder_transaction *t,
 	return 0;
 }
 
-static void binder_transaction(struct binder_proc *proc,
-			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply,
-			       binder_size_t extra_buffers_size)
+static void binder_transaction_locked(struct binder_proc *proc,
+				      struct binder_thread *thread,
+				      struct binder_transaction_data *tr,
+				      int reply,
+				      binder_size_t extra_buffers_size,
+				      struct binder_proc *prealloc_proc,
+				      struct binder_buffer **prealloc)
 {
 	int ret;
+	bool copied = false;
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
 	binder_size_t *offp, *off_end, *off_start;
@@ -1943,7 +2374,7 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		binder_set_priority(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("%d:%d got reply transaction with bad transaction stack, transaction %d has target %d:%d\n",
 				proc->pid, thread->pid, in_reply_to->debug_id,
@@ -1997,7 +2428,13 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
-		if (security_binder_transaction(proc->tsk, target_proc->tsk) < 0) {
+		/*
+		 * binder_transaction_pin_target() already checked a pinned
+		 * target before its buffer was filled.
+		 */
+		if (target_proc != prealloc_proc &&
+		    security_binder_transaction(proc->tsk,
+						target_proc->tsk) < 0) {
 			return_error = BR_FAILED_REPLY;
 			goto err_invalid_target_handle;
 		}
@@ -2086,13 +2523,18 @@ static void binder_transaction(struct binder_proc *proc,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_get_priority(current);
 
 	trace_binder_transaction(reply, t, target_node);
 
-	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, extra_buffers_size,
-		!reply && (t->flags & TF_ONE_WAY));
+	if (*prealloc && prealloc_proc == target_proc) {
+		t->buffer = *prealloc;
+		*prealloc = NULL;
+		copied = true;
+	} else
+		t->buffer = binder_alloc_buf(target_proc, tr->data_size,
+			tr->offsets_size, extra_buffers_size,
+			!reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
@@ -2109,14 +2551,16 @@ static void binder_transaction(struct binder_proc *proc,
 				      ALIGN(tr->data_size, sizeof(void *)));
 	offp = off_start;
 
-	if (copy_from_user(t->buffer->data, (const void __user *)(uintptr_t)
+	if (!copied &&
+	    copy_from_user(t->buffer->data, (const void __user *)(uintptr_t)
 			   tr->data.ptr.buffer, tr->data_size)) {
 		binder_user_error("%d:%d got transaction with invalid data ptr\n",
 				proc->pid, thread->pid);
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
-	if (copy_from_user(offp, (const void __user *)(uintptr_t)
+	if (!copied &&
+	    copy_from_user(offp, (const void __user *)(uintptr_t)
 			   tr->data.ptr.offsets, tr->offsets_size)) {
 		binder_user_error("%d:%d got transaction with invalid offsets ptr\n",
 				proc->pid, thread->pid);
@@ -2265,8 +2709,17 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	t->queue_time = ktime_get();
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		/*
+		 * The node is only known while the request buffer has not
+		 * been freed yet, which is the common case at reply time.
+		 */
+		binder_latency_add(proc, in_reply_to->buffer ?
+				   in_reply_to->buffer->target_node : NULL,
+				   in_reply_to, BINDER_LATENCY_PROCESS,
+				   in_reply_to->deliver_time, t->queue_time);
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
@@ -2284,6 +2737,8 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	t->work.type = BINDER_WORK_TRANSACTION;
 	list_add_tail(&t->work.entry, target_list);
+	if (target_wait)
+		binder_todo_depth_inc(target_proc);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
@@ -2330,6 +2785,107 @@ err_no_context_mgr_node:
 		thread->return_error = return_error;
 }
 
+/*
+ * Guess where a transaction is going and pin that proc, so that its
+ * buffer can be allocated and filled with binder_main_lock dropped.
+ * binder_transaction_locked() looks the target up again and only uses
+ * the buffer if the guess still holds.
+ */
+static struct binder_proc *binder_transaction_pin_target(
+					struct binder_proc *proc,
+					struct binder_thread *thread,
+					struct binder_transaction_data *tr,
+					int reply)
+{
+	struct binder_proc *target_proc = NULL;
+
+	if (reply) {
+		struct binder_transaction *in_reply_to;
+
+		in_reply_to = thread->transaction_stack;
+		if (in_reply_to && in_reply_to->to_thread == thread &&
+		    in_reply_to->from)
+			target_proc = in_reply_to->from->proc;
+	} else if (tr->target.handle) {
+		struct binder_ref *ref;
+
+		ref = binder_get_ref(proc, tr->target.handle, false);
+		if (ref && ref->strong)
+			target_proc = ref->node->proc;
+	} else if (proc->context->binder_context_mgr_node) {
+		target_proc = proc->context->binder_context_mgr_node->proc;
+	}
+	if (target_proc == NULL || target_proc->is_dead)
+		return NULL;
+	/* the data must not reach a proc that may not receive it */
+	if (!reply &&
+	    security_binder_transaction(proc->tsk, target_proc->tsk) < 0)
+		return NULL;
+
+	target_proc->tmp_ref++;
+	return target_proc;
+}
+
+static struct binder_buffer *binder_transaction_prealloc(
+					struct binder_proc *target_proc,
+					struct binder_transaction_data *tr,
+					int reply,
+					binder_size_t extra_buffers_size)
+{
+	struct binder_buffer *buffer;
+	binder_size_t *offp;
+
+	buffer = binder_alloc_buf(target_proc, tr->data_size,
+		tr->offsets_size, extra_buffers_size,
+		!reply && (tr->flags & TF_ONE_WAY));
+	if (buffer == NULL)
+		return NULL;
+
+	offp = (binder_size_t *)(buffer->data +
+				 ALIGN(tr->data_size, sizeof(void *)));
+	if (copy_from_user(buffer->data, (const void __user *)(uintptr_t)
+			   tr->data.ptr.buffer, tr->data_size) ||
+	    copy_from_user(offp, (const void __user *)(uintptr_t)
+			   tr->data.ptr.offsets, tr->offsets_size)) {
+		/* let binder_transaction_locked() report the error */
+		binder_free_buf(target_proc, buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+static void binder_transaction(struct binder_proc *proc,
+			       struct binder_thread *thread,
+			       struct binder_transaction_data *tr, int reply,
+			       binder_size_t extra_buffers_size)
+{
+	struct binder_proc *target_proc = NULL;
+	struct binder_buffer *buffer = NULL;
+
+	/*
+	 * Allocating and filling a large buffer can fault and map pages,
+	 * do that without binder_main_lock held. Small transactions are
+	 * cheaper to handle in one go.
+	 */
+	if (tr->data_size + tr->offsets_size >= BINDER_UNLOCKED_COPY_MIN)
+		target_proc = binder_transaction_pin_target(proc, thread, tr,
+							    reply);
+	if (target_proc) {
+		binder_unlock(__func__);
+		buffer = binder_transaction_prealloc(target_proc, tr, reply,
+						     extra_buffers_size);
+		binder_lock(__func__);
+	}
+
+	binder_transaction_locked(proc, thread, tr, reply, extra_buffers_size,
+				  target_proc, &buffer);
+
+	if (buffer)
+		binder_free_buf(target_proc, buffer);
+	if (target_proc)
+		binder_proc_dec_tmpref(target_proc);
+}
+
 static int binder_thread_write(struct binder_proc *proc,
 			struct binder_thread *thread,
 			binder_uintptr_t binder_buffer, size_t size,
@@ -2347,9 +2903,9 @@ static int binder_thread_write(struct binder_proc *proc,
 		ptr += sizeof(uint32_t);
 		trace_binder_command(cmd);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -2508,8 +3064,10 @@ static int binder_thread_write(struct binder_proc *proc,
 				BUG_ON(!buffer->target_node->has_async_transaction);
 				if (list_empty(&buffer->target_node->async_todo))
 					buffer->target_node->has_async_transaction = 0;
-				else
+				else {
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+					binder_todo_depth_inc(proc);
+				}
 			}
 			trace_binder_transaction_buffer_release(buffer);
 			binder_transaction_buffer_release(proc, buffer, NULL);
@@ -2715,9 +3273,9 @@ static void binder_stat_br(struct binder_proc *proc,
 {
 	trace_binder_return(cmd);
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2792,7 +3350,7 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_set_priority(proc->default_priority);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
@@ -2963,13 +3521,7 @@ retry:
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			binder_transaction_priority(t, target_node);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = 0;
@@ -3017,6 +3569,12 @@ retry:
 			     (u64)tr.data.ptr.buffer, (u64)tr.data.ptr.offsets);
 
 		list_del(&t->work.entry);
+		proc->todo_depth--;
+		t->deliver_time = ktime_get();
+		binder_latency_add(proc, t->buffer->target_node, t,
+				   cmd == BR_TRANSACTION ?
+				   BINDER_LATENCY_QUEUE : BINDER_LATENCY_REPLY,
+				   t->queue_time, t->deliver_time);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
@@ -3138,6 +3696,7 @@ static int binder_free_thread(struct binder_proc *proc,
 {
 	struct binder_transaction *t;
 	struct binder_transaction *send_reply = NULL;
+	struct binder_work *w;
 	int active_transactions = 0;
 
 	rb_erase(&thread->rb_node, &proc->threads);
@@ -3168,6 +3727,9 @@ static int binder_free_thread(struct binder_proc *proc,
 	}
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
+	list_for_each_entry(w, &thread->todo, entry)
+		if (w->type == BINDER_WORK_TRANSACTION)
+			proc->todo_depth--;
 	binder_release_work(&thread->todo);
 	kfree(thread);
 	binder_stats_deleted(BINDER_STAT_THREAD);
@@ -3371,14 +3933,38 @@ static void binder_vma_close(struct vm_area_struct *vma)
 	binder_defer_work(proc, BINDER_DEFERRED_PUT_FILES);
 }
 
+static int binder_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct binder_proc *proc = vma->vm_private_data;
+	void *kern_addr;
+	struct page *page;
+
+	kern_addr = (void *)((uintptr_t)vmf->virtual_address -
+			     proc->user_buffer_offset);
+	if (kern_addr < proc->buffer ||
+	    kern_addr >= proc->buffer + proc->buffer_size)
+		return VM_FAULT_SIGBUS;
+
+	/* pages are only taken away with mmap_sem held for writing */
+	page = ACCESS_ONCE(proc->pages[(kern_addr - proc->buffer) /
+				       PAGE_SIZE]);
+	if (page == NULL)
+		return VM_FAULT_SIGBUS;
+
+	get_page(page);
+	vmf->page = page;
+	return 0;
+}
+
 static struct vm_operations_struct binder_vm_ops = {
 	.open = binder_vma_open,
 	.close = binder_vma_close,
+	.fault = binder_vm_fault,
 };
 
 static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	int ret;
+	int ret, i;
 	struct vm_struct *area;
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
@@ -3435,6 +4021,16 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	proc->page_lru = kmalloc(sizeof(proc->page_lru[0]) *
+				 (proc->buffer_size / PAGE_SIZE), GFP_KERNEL);
+	if (proc->page_lru == NULL) {
+		ret = -ENOMEM;
+		failure_string = "alloc page lru";
+		goto err_alloc_page_lru_failed;
+	}
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++)
+		INIT_LIST_HEAD(&proc->page_lru[i]);
+	INIT_LIST_HEAD(&proc->lru_pages);
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -3450,6 +4046,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	buffer->free = 1;
 	binder_insert_free_buffer(proc, buffer);
 	proc->free_async_space = proc->buffer_size / 2;
+	proc->free_space = proc->buffer_size;
 	barrier();
 	proc->files = get_files_struct(current);
 	proc->vma = vma;
@@ -3460,6 +4057,9 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 
 err_alloc_small_buf_failed:
+	kfree(proc->page_lru);
+	proc->page_lru = NULL;
+err_alloc_page_lru_failed:
 	kfree(proc->pages);
 	proc->pages = NULL;
 err_alloc_pages_failed:
@@ -3490,20 +4090,19 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current->group_leader;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
+	mutex_init(&proc->alloc_lock);
+	proc->default_priority = binder_get_priority(current);
 	binder_dev = container_of(filp->private_data, struct binder_device,
 				  miscdev);
 	proc->context = &binder_dev->context;
-
-	binder_lock(__func__);
-
-	binder_stats_created(BINDER_STAT_PROC);
-	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
 
-	binder_unlock(__func__);
+	binder_stats_created(BINDER_STAT_PROC);
+	mutex_lock(&binder_procs_lock);
+	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_unlock(&binder_procs_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -3564,16 +4163,17 @@ static int binder_release(struct inode *nodp, struct file *filp)
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
-	struct binder_transaction *t;
 	struct binder_context *context = proc->context;
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers,
-		active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
 
+	mutex_lock(&binder_procs_lock);
 	hlist_del(&proc->proc_node);
+	mutex_unlock(&binder_procs_lock);
+	proc->is_dead = true;
 
 	if (context->binder_context_mgr_node &&
 	    context->binder_context_mgr_node->proc == proc) {
@@ -3645,57 +4245,14 @@ static void binder_deferred_release(struct binder_proc *proc)
 	binder_release_work(&proc->todo);
 	binder_release_work(&proc->delivered_death);
 
-	buffers = 0;
-	while ((n = rb_first(&proc->allocated_buffers))) {
-		struct binder_buffer *buffer;
-
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-
-		t = buffer->transaction;
-		if (t) {
-			t->buffer = NULL;
-			buffer->transaction = NULL;
-			pr_err("release proc %d, transaction %d, not freed\n",
-			       proc->pid, t->debug_id);
-			/*BUG();*/
-		}
-
-		binder_free_buf(proc, buffer);
-		buffers++;
-	}
-
-	binder_stats_deleted(BINDER_STAT_PROC);
-
-	page_count = 0;
-	if (proc->pages) {
-		int i;
-
-		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			void *page_addr;
-
-			if (!proc->pages[i])
-				continue;
-
-			page_addr = proc->buffer + i * PAGE_SIZE;
-			binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-				     "%s: %d: page %d at %pK not freed\n",
-				     __func__, proc->pid, i, page_addr);
-			unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
-			__free_page(proc->pages[i]);
-			page_count++;
-		}
-		kfree(proc->pages);
-		vfree(proc->buffer);
-	}
-
-	put_task_struct(proc->tsk);
-
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
-		     "%s: %d threads %d, nodes %d (ref %d), refs %d, active transactions %d, buffers %d, pages %d\n",
+		     "%s: %d threads %d, nodes %d (ref %d), refs %d, active transactions %d\n",
 		     __func__, proc->pid, threads, nodes, incoming_refs,
-		     outgoing_refs, active_transactions, buffers, page_count);
+		     outgoing_refs, active_transactions);
 
-	kfree(proc);
+	/* senders still filling our buffers free the proc when done */
+	if (!proc->tmp_ref)
+		binder_free_proc(proc);
 }
 
 static void binder_deferred_func(struct work_struct *work)
@@ -3756,13 +4313,14 @@ static void print_binder_transaction(struct seq_file *m, const char *prefix,
 				     struct binder_transaction *t)
 {
 	seq_printf(m,
-		   "%s %d: %pK from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+		   "%s %d: %pK from %d:%d to %d:%d code %x flags %x pri %d:%d r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
 		   t->to_proc ? t->to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
-		   t->code, t->flags, t->priority, t->need_reply);
+		   t->code, t->flags, t->priority.sched_policy,
+		   t->priority.prio, t->need_reply);
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3915,9 +4473,11 @@ static void print_binder_proc(struct seq_file *m,
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
 	}
+	binder_alloc_lock(proc, __func__);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	binder_alloc_unlock(proc);
 	list_for_each_entry(w, &proc->todo, entry)
 		print_binder_work(m, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
@@ -3989,17 +4549,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -4007,11 +4571,13 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
 	}
 }
 
@@ -4030,9 +4596,12 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  threads: %d\n", count);
 	seq_printf(m, "  requested threads: %d+%d/%d\n"
 			"  ready threads %d\n"
-			"  free async space %zd\n", proc->requested_threads,
+			"  free async space %zd\n"
+			"  free space %zd\n"
+			"  cached pages %zd\n", proc->requested_threads,
 			proc->requested_threads_started, proc->max_threads,
-			proc->ready_threads, proc->free_async_space);
+			proc->ready_threads, proc->free_async_space,
+			proc->free_space, proc->lru_count);
 	count = 0;
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n))
 		count++;
@@ -4050,8 +4619,10 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	binder_alloc_lock(proc, __func__);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	binder_alloc_unlock(proc);
 	seq_printf(m, "  buffers: %d\n", count);
 
 	count = 0;
@@ -4087,8 +4658,10 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node)
 		print_binder_node(m, node);
 
+	mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
+	mutex_unlock(&binder_procs_lock);
 	if (do_lock)
 		binder_unlock(__func__);
 	return 0;
@@ -4107,8 +4680,10 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 
 	print_binder_stats(m, "", &binder_stats);
 
+	mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
+	mutex_unlock(&binder_procs_lock);
 	if (do_lock)
 		binder_unlock(__func__);
 	return 0;
@@ -4124,8 +4699,81 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 		binder_lock(__func__);
 
 	seq_puts(m, "binder transactions:\n");
+	mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
+	mutex_unlock(&binder_procs_lock);
+	if (do_lock)
+		binder_unlock(__func__);
+	return 0;
+}
+
+static const char * const binder_latency_strings[] = {
+	"queue",
+	"process",
+	"reply",
+};
+
+static bool binder_latency_empty(u32 *hist)
+{
+	int i;
+
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+		if (hist[i])
+			return false;
+	return true;
+}
+
+static void print_binder_latency(struct seq_file *m, const char *prefix,
+				 struct binder_latency *latency, int types)
+{
+	int type, i;
+
+	for (type = 0; type < types; type++) {
+		u32 *hist = latency->hist[type];
+
+		if (binder_latency_empty(hist))
+			continue;
+		seq_printf(m, "%s%s:", prefix, binder_latency_strings[type]);
+		for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+			seq_printf(m, " %u", hist[i]);
+		seq_puts(m, "\n");
+	}
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct binder_node *node;
+	struct rb_node *n;
+	struct hlist_node *pos;
+	int do_lock = !binder_debug_no_lock;
+	int i;
+
+	if (do_lock)
+		binder_lock(__func__);
+
+	seq_puts(m, "binder latency, buckets from (us):");
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+		seq_printf(m, " %u", i ? 4U << i : 0);
+	seq_puts(m, "\n");
+
+	mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		seq_printf(m, "proc %d todo depth %d max %d\n", proc->pid,
+			   proc->todo_depth, proc->max_todo_depth);
+		print_binder_latency(m, "  ", &proc->latency,
+				     BINDER_LATENCY_COUNT);
+		for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+			node = rb_entry(n, struct binder_node, rb_node);
+			if (binder_latency_empty(node->latency.hist[BINDER_LATENCY_QUEUE]))
+				continue;
+			seq_printf(m, "  node %d\n", node->debug_id);
+			print_binder_latency(m, "    ", &node->latency,
+					     BINDER_LATENCY_REPLY);
+		}
+	}
+	mutex_unlock(&binder_procs_lock);
 	if (do_lock)
 		binder_unlock(__func__);
 	return 0;
@@ -4141,12 +4789,14 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	if (do_lock)
 		binder_lock(__func__);
 
+	mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(itr, pos, &binder_procs, proc_node) {
 		if (itr->pid == pid) {
 			seq_puts(m, "binder proc state:\n");
 			print_binder_proc(m, itr, 1);
 		}
 	}
+	mutex_unlock(&binder_procs_lock);
 	if (do_lock)
 		binder_unlock(__func__);
 	return 0;
@@ -4192,6 +4842,7 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(latency);
 
 static int __init init_binder_device(const char *name)
 {
@@ -4252,6 +4903,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    NULL,
 				    &binder_transactions_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 		debugfs_create_file("transaction_log",
 				    S_IRUGO,
 				    binder_debugfs_dir_entry_root,
@@ -63,6 +63,23 @@ DEFINE_BINDER_LOCK_EVENT(binder_lock);
 DEFINE_BINDER_LOCK_EVENT(binder_locked);
 DEFINE_BINDER_LOCK_EVENT(binder_unlock);
 
+TRACE_EVENT(binder_lock_wait,
+	TP_PROTO(const char *lock, const char *tag, u64 wait_ns),
+	TP_ARGS(lock, tag, wait_ns),
+	TP_STRUCT__entry(
+		__field(const char *, lock)
+		__field(const char *, tag)
+		__field(u64, wait_ns)
+	),
+	TP_fast_assign(
+		__entry->lock = lock;
+		__entry->tag = tag;
+		__entry->wait_ns = wait_ns;
+	),
+	TP_printk("lock=%s tag=%s wait_ns=%llu",
+		  __entry->lock, __entry->tag, __entry->wait_ns)
+);
+
 DECLARE_EVENT_CLASS(binder_function_return_class,
 	TP_PROTO(int ret),
 	TP_ARGS(ret),
@@ -84,6 +101,68 @@ DEFINE_BINDER_FUNCTION_RETURN_EVENT(binder_ioctl_done);
 DEFINE_BINDER_FUNCTION_RETURN_EVENT(binder_write_done);
 DEFINE_BINDER_FUNCTION_RETURN_EVENT(binder_read_done);
 
+TRACE_EVENT(binder_set_priority,
+	TP_PROTO(int thread, unsigned int old_policy, int old_prio,
+		 unsigned int new_policy, int new_prio),
+	TP_ARGS(thread, old_policy, old_prio, new_policy, new_prio),
+	TP_STRUCT__entry(
+		__field(int, thread)
+		__field(unsigned int, old_policy)
+		__field(int, old_prio)
+		__field(unsigned int, new_policy)
+		__field(int, new_prio)
+	),
+	TP_fast_assign(
+		__entry->thread = thread;
+		__entry->old_policy = old_policy;
+		__entry->old_prio = old_prio;
+		__entry->new_policy = new_policy;
+		__entry->new_prio = new_prio;
+	),
+	TP_printk("thread=%d %u:%d => %u:%d",
+		  __entry->thread, __entry->old_policy, __entry->old_prio,
+		  __entry->new_policy, __entry->new_prio)
+);
+
+TRACE_EVENT(binder_transaction_latency,
+	TP_PROTO(struct binder_transaction *t, int type, s64 usecs),
+	TP_ARGS(t, type, usecs),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, type)
+		__field(s64, usecs)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->type = type;
+		__entry->usecs = usecs;
+	),
+	TP_printk("transaction=%d %s=%lldus",
+		  __entry->debug_id,
+		  __print_symbolic(__entry->type,
+				   { 0, "queue" },
+				   { 1, "process" },
+				   { 2, "reply" }),
+		  __entry->usecs)
+);
+
+TRACE_EVENT(binder_todo_depth,
+	TP_PROTO(struct binder_proc *proc, int depth),
+	TP_ARGS(proc, depth),
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, depth)
+		__field(int, max_depth)
+	),
+	TP_fast_assign(
+		__entry->proc = proc->pid;
+		__entry->depth = depth;
+		__entry->max_depth = proc->max_todo_depth;
+	),
+	TP_printk("proc=%d depth=%d max=%d",
+		  __entry->proc, __entry->depth, __entry->max_depth)
+);
+
 TRACE_EVENT(binder_wait_for_work,
 	TP_PROTO(bool proc_work, bool transaction_stack, bool thread_todo),
 	TP_ARGS(proc_work, transaction_stack, thread_todo),
@@ -25,6 +25,7 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/mm.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -49,6 +50,7 @@ struct logger_log {
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_info	*info;	/* first page of an mmap() */
 };
 
 /*
@@ -62,6 +64,7 @@ struct logger_reader {
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
 	bool			r_all;	/* reader can read all entries */
+	bool			r_batch; /* read() returns many entries */
 	int			r_ver;	/* reader ABI version */
 };
 
@@ -210,6 +213,85 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	return count + get_user_hdr_len(reader->r_ver);
 }
 
+/*
+ * do_read_log_batch_to_user - reads as many whole entries as fit into
+ * 'count' bytes from 'log' into the user-space buffer 'buf'. Returns the
+ * number of bytes read.
+ *
+ * For readers of all entries with the version 2 ABI the ring already holds
+ * what they expect, so the entries are copied in at most two chunks.
+ *
+ * Caller must hold log->mutex.
+ */
+static ssize_t do_read_log_batch_to_user(struct logger_log *log,
+					 struct logger_reader *reader,
+					 char __user *buf,
+					 size_t count)
+{
+	size_t off = reader->r_off;
+	size_t total = 0;
+	size_t len;
+
+	while (off != log->w_off) {
+		len = sizeof(struct logger_entry) + get_entry_msg_len(log, off);
+		if (count - total < len)
+			break;
+		total += len;
+		off = logger_offset(off + len);
+	}
+
+	len = min(total, log->size - reader->r_off);
+	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+		return -EFAULT;
+	if (total != len)
+		if (copy_to_user(buf + len, log->buffer, total - len))
+			return -EFAULT;
+
+	reader->r_off = off;
+
+	return total;
+}
+
+static size_t get_next_entry_by_uid(struct logger_log *log,
+		size_t off, uid_t euid);
+
+/*
+ * do_read_log_entries_to_user - reads as many whole entries readable by
+ * 'reader' as fit into 'count' bytes, one by one. Returns the number of
+ * bytes read.
+ *
+ * Caller must hold log->mutex.
+ */
+static ssize_t do_read_log_entries_to_user(struct logger_log *log,
+					   struct logger_reader *reader,
+					   char __user *buf,
+					   size_t count)
+{
+	ssize_t total = 0;
+	ssize_t ret;
+	size_t len;
+
+	while (1) {
+		if (!reader->r_all)
+			reader->r_off = get_next_entry_by_uid(log,
+				reader->r_off, current_euid());
+		if (log->w_off == reader->r_off)
+			break;
+
+		len = get_user_hdr_len(reader->r_ver) +
+			get_entry_msg_len(log, reader->r_off);
+		if (count - total < len)
+			break;
+
+		ret = do_read_log_to_user(log, reader, buf + total, len);
+		if (ret < 0)
+			return total ? total : ret;
+		total += ret;
+	}
+
+	return total;
+}
+
 /*
  * get_next_entry_by_uid - Starting at 'off', returns an offset into
  * 'log->buffer' which contains the first entry readable by 'euid'
@@ -241,7 +323,8 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or as many whole entries as
+ * 	  fit into the buffer after LOGGER_SET_BATCH_READ
  *
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -301,8 +384,13 @@ start:
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (!reader->r_batch)
+		/* get exactly one entry from the log */
+		ret = do_read_log_to_user(log, reader, buf, ret);
+	else if (reader->r_all && reader->r_ver >= 2)
+		ret = do_read_log_batch_to_user(log, reader, buf, count);
+	else
+		ret = do_read_log_entries_to_user(log, reader, buf, count);
 
 out:
 	mutex_unlock(&log->mutex);
@@ -361,14 +449,36 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (clock_interval(old, new, log->head)) {
+		size_t head = get_next_entry(log, log->head, len);
+
+		log->info->head_pos += logger_offset(head - log->head);
+		log->head = head;
+	}
 
 	list_for_each_entry(reader, &log->readers, list)
 		if (clock_interval(old, new, reader->r_off))
 			reader->r_off = get_next_entry(log, reader->r_off, len);
 }
 
+/*
+ * logger_write_begin/end - bracket changes of the ring, so that mmap()
+ * readers can tell whether they saw a consistent state.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static inline void logger_write_begin(struct logger_log *log)
+{
+	log->info->seq++;
+	smp_wmb();
+}
+
+static inline void logger_write_end(struct logger_log *log)
+{
+	smp_wmb();
+	log->info->seq++;
+}
+
 /*
  * do_write_log - writes 'len' bytes from 'buf' to 'log'
  *
@@ -460,6 +570,7 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		return 0;
 
 	mutex_lock(&log->mutex);
+	logger_write_begin(log);
 
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
@@ -482,6 +593,7 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		nr = do_write_log_from_user(log, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
 			log->w_off = orig;
+			logger_write_end(log);
 			mutex_unlock(&log->mutex);
 			return nr;
 		}
@@ -490,6 +602,8 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		ret += nr;
 	}
 
+	log->info->w_pos += sizeof(struct logger_entry) + ret;
+	logger_write_end(log);
 	mutex_unlock(&log->mutex);
 
 	/* wake up any blocked readers */
@@ -527,6 +641,7 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		reader->r_ver = 1;
+		reader->r_batch = false;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
@@ -602,6 +717,72 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	return ret;
 }
 
+/*
+ * logger_mmap - maps the log read-only: the logger_mmap_info page, followed
+ * by the ring buffer. Only readers of all entries may do this, as the ring
+ * holds every uid's entries.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (!reader->r_all || (vma->vm_flags & VM_WRITE))
+		return -EPERM;
+	if (vma->vm_pgoff || size > PAGE_SIZE + log->size)
+		return -EINVAL;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(log->info) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret || size == PAGE_SIZE)
+		return ret;
+
+#ifdef MODULE
+	/*
+	 * Built as a module, the static buffers live in module space, which
+	 * is neither linearly mapped nor physically contiguous.
+	 */
+	{
+		unsigned long off;
+
+		for (off = 0; off < size - PAGE_SIZE; off += PAGE_SIZE) {
+			ret = remap_pfn_range(vma,
+					vma->vm_start + PAGE_SIZE + off,
+					vmalloc_to_pfn(log->buffer + off),
+					PAGE_SIZE, vma->vm_page_prot);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+#else
+	return remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+			       virt_to_phys(log->buffer) >> PAGE_SHIFT,
+			       size - PAGE_SIZE, vma->vm_page_prot);
+#endif
+}
+
+static long logger_set_batch_read(struct logger_reader *reader,
+				  void __user *arg)
+{
+	int batch;
+	if (copy_from_user(&batch, arg, sizeof(int)))
+		return -EFAULT;
+
+	reader->r_batch = !!batch;
+	return 0;
+}
+
 static long logger_set_version(struct logger_reader *reader, void __user *arg)
 {
 	int version;
@@ -663,7 +844,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		list_for_each_entry(reader, &log->readers, list)
 			reader->r_off = log->w_off;
+		logger_write_begin(log);
 		log->head = log->w_off;
+		log->info->head_pos = log->info->w_pos;
+		logger_write_end(log);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -682,6 +866,14 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		reader = file->private_data;
 		ret = logger_set_version(reader, argp);
 		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = logger_set_batch_read(reader, argp);
+		break;
 	}
 
 	mutex_unlock(&log->mutex);
@@ -694,6 +886,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -703,10 +896,11 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)). The buffer is
+ * page aligned so that it can be mapped to userspace.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -752,6 +946,11 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->info = (struct logger_mmap_info *)get_zeroed_page(GFP_KERNEL);
+	if (unlikely(!log->info))
+		return -ENOMEM;
+	log->info->size = log->size;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 //		printk(KERN_ERR "logger: failed to register misc "
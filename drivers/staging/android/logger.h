@@ -51,6 +51,26 @@ struct logger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * The first page of a read-only mmap() of a log, followed by the ring
+ * buffer itself. Positions count the bytes written since boot, the ring
+ * offset of a position is pos & (size - 1).
+ *
+ * seq is odd while a write is in progress. A reader snapshots head_pos
+ * and w_pos with an even, unchanged seq and copies the entries between
+ * its position and w_pos, starting over at head_pos if it fell behind.
+ * Entries that lie before head_pos read after the copy have been
+ * overwritten meanwhile and must be dropped. Entries are laid out as
+ * struct logger_entry followed by the payload and may wrap around the
+ * end of the ring.
+ */
+struct logger_mmap_info {
+	__u32		seq;		/* odd while the log is written to */
+	__u32		size;		/* size of the ring buffer */
+	__u64		head_pos;	/* oldest entry still in the ring */
+	__u64		w_pos;		/* where the next entry goes */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -67,5 +87,6 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 7) /* many entries per read */
 
 #endif /* _LINUX_LOGGER_H */
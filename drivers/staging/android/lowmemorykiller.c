@@ -17,6 +17,10 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * With /sys/module/lowmemorykiller/parameters/vmpressure_mode set to 1 the
+ * minfree values are ignored and the vmpressure level picks the entry of
+ * the adj array to kill from instead, see lowmem_vmpressure_notifier().
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -41,7 +45,10 @@
 #include <linux/swap.h>
 #include <linux/ratelimit.h>
 #include <linux/rcupdate.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
 #include <linux/notifier.h>
+#include <linux/vmpressure.h>
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_DO_NOT_KILL_PROCESS
 #include <linux/string.h>
 #endif
@@ -106,6 +113,43 @@ static bool is_in_donotkill_proc_list(char *proc_name)
 
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * Thread group leaders of user processes, sorted by the oom_score_adj they
+ * had when last (re)inserted. Whoever changes oom_score_adj calls
+ * lowmem_task_update_adj() afterwards, so the tree only lags behind for
+ * the duration of that window.
+ */
+static DEFINE_SPINLOCK(lowmem_adj_lock);
+static struct rb_root lowmem_adj_tree = RB_ROOT;
+
+static uint32_t lowmem_tasks_scanned;
+static uint32_t lowmem_kill_count;
+
+/*
+ * vmpressure kill mode: the kill level counts how many entries of the adj
+ * array, from the highest one down, may be killed. It goes up by one after
+ * 'vmpressure_windows' consecutive vmpressure windows at or above
+ * 'vmpressure_critical', and down by one after as many windows in which
+ * the averaged pressure stayed below 'vmpressure_relax'. Since no windows
+ * close once reclaim stops, it also goes down by one for every
+ * 'vmpressure_decay_ms' without a critical window, 0 disables that.
+ */
+static uint32_t lowmem_vmpressure_mode;
+static uint32_t lowmem_vmpressure_critical = 95;
+static uint32_t lowmem_vmpressure_relax = 60;
+static uint32_t lowmem_vmpressure_windows = 2;
+/* hold off while anon memory that fits into free swap exceeds this % of RAM */
+static uint32_t lowmem_vmpressure_swap_reserve = 10;
+static uint32_t lowmem_vmpressure_decay_ms = 1000;
+
+static DEFINE_SPINLOCK(lowmem_vmpressure_lock);
+static int lowmem_vmpressure_level;
+static unsigned long lowmem_vmpressure_avg;
+static unsigned int lowmem_vmpressure_hot;
+static unsigned int lowmem_vmpressure_calm;
+/* jiffies of the last critical window or decay step */
+static unsigned long lowmem_vmpressure_stamp;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -118,10 +162,185 @@ static unsigned long lowmem_deathpending_timeout;
 			pr_err_ratelimited(x);			\
 	} while (0)
 
+/* Caller must hold lowmem_adj_lock */
+static void __lowmem_task_insert(struct task_struct *task)
+{
+	struct rb_node **link = &lowmem_adj_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct task_struct *entry;
+
+	task->adj_key = task->signal->oom_score_adj;
+	while (*link) {
+		parent = *link;
+		entry = rb_entry(parent, struct task_struct, adj_node);
+		if (task->adj_key < entry->adj_key)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&task->adj_node, parent, link);
+	rb_insert_color(&task->adj_node, &lowmem_adj_tree);
+}
+
+/* Caller must hold lowmem_adj_lock */
+static void __lowmem_task_erase(struct task_struct *task)
+{
+	rb_erase(&task->adj_node, &lowmem_adj_tree);
+	RB_CLEAR_NODE(&task->adj_node);
+}
+
+/*
+ * lowmem_task_add - index a new thread group leader. Called once the
+ * task is fully set up at fork, and for the thread that takes over as
+ * leader in exec.
+ */
+void lowmem_task_add(struct task_struct *task)
+{
+	if (!thread_group_leader(task) || (task->flags & PF_KTHREAD))
+		return;
+
+	spin_lock(&lowmem_adj_lock);
+	if (RB_EMPTY_NODE(&task->adj_node))
+		__lowmem_task_insert(task);
+	spin_unlock(&lowmem_adj_lock);
+}
+
+/* lowmem_task_del - drop a task from the index when it is released */
+void lowmem_task_del(struct task_struct *task)
+{
+	spin_lock(&lowmem_adj_lock);
+	if (!RB_EMPTY_NODE(&task->adj_node))
+		__lowmem_task_erase(task);
+	spin_unlock(&lowmem_adj_lock);
+}
+
+/*
+ * lowmem_task_update_adj - move the thread group of @task to the bucket of
+ * its current oom_score_adj. Must not be called with task_lock() or the
+ * siglock held.
+ */
+void lowmem_task_update_adj(struct task_struct *task)
+{
+	struct task_struct *leader;
+
+	rcu_read_lock();
+	leader = task->group_leader;
+	spin_lock(&lowmem_adj_lock);
+	if (!RB_EMPTY_NODE(&leader->adj_node) &&
+	    leader->adj_key != leader->signal->oom_score_adj) {
+		__lowmem_task_erase(leader);
+		__lowmem_task_insert(leader);
+	}
+	spin_unlock(&lowmem_adj_lock);
+	rcu_read_unlock();
+}
+
+/*
+ * lowmem_swap_reclaimable - true if swapping can still free a significant
+ * amount of memory, in which case pressure is no reason to kill.
+ */
+static bool lowmem_swap_reclaimable(void)
+{
+	unsigned long anon;
+
+	if (!total_swap_pages)
+		return false;
+
+	anon = global_page_state(NR_ACTIVE_ANON) +
+		global_page_state(NR_INACTIVE_ANON);
+	anon = min_t(unsigned long, anon, nr_swap_pages);
+
+	return anon * 100 > totalram_pages * lowmem_vmpressure_swap_reserve;
+}
+
+/* Caller must hold lowmem_vmpressure_lock */
+static void lowmem_vmpressure_decay(void)
+{
+	unsigned long period = msecs_to_jiffies(lowmem_vmpressure_decay_ms);
+
+	if (!period)
+		return;
+
+	while (lowmem_vmpressure_level > 0 &&
+	       time_after_eq(jiffies, lowmem_vmpressure_stamp + period)) {
+		lowmem_vmpressure_level--;
+		lowmem_vmpressure_stamp += period;
+	}
+}
+
+static int lowmem_vmpressure_notifier(struct notifier_block *nb,
+				      unsigned long action, void *data)
+{
+	unsigned long pressure = action;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if (!lowmem_vmpressure_mode)
+		return 0;
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+
+	spin_lock(&lowmem_vmpressure_lock);
+	lowmem_vmpressure_decay();
+	lowmem_vmpressure_avg = (lowmem_vmpressure_avg * 3 + pressure) / 4;
+
+	if (pressure >= lowmem_vmpressure_critical &&
+	    !lowmem_swap_reclaimable()) {
+		lowmem_vmpressure_calm = 0;
+		lowmem_vmpressure_stamp = jiffies;
+		if (++lowmem_vmpressure_hot >= lowmem_vmpressure_windows) {
+			lowmem_vmpressure_hot = 0;
+			if (lowmem_vmpressure_level < array_size)
+				lowmem_vmpressure_level++;
+		}
+	} else if (lowmem_vmpressure_avg < lowmem_vmpressure_relax) {
+		lowmem_vmpressure_hot = 0;
+		if (++lowmem_vmpressure_calm >= lowmem_vmpressure_windows) {
+			lowmem_vmpressure_calm = 0;
+			if (lowmem_vmpressure_level > 0)
+				lowmem_vmpressure_level--;
+		}
+	} else {
+		/* in between the thresholds the level is kept */
+		lowmem_vmpressure_hot = 0;
+		lowmem_vmpressure_calm = 0;
+	}
+	spin_unlock(&lowmem_vmpressure_lock);
+
+	lowmem_print(5, "vmpressure %lu, avg %lu, level %d\n", pressure,
+		     lowmem_vmpressure_avg, lowmem_vmpressure_level);
+
+	return 0;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call = lowmem_vmpressure_notifier,
+};
+
+/* The lowest oom_score_adj the current vmpressure level allows to kill */
+static int lowmem_vmpressure_min_adj(int array_size)
+{
+	int level;
+
+	spin_lock(&lowmem_vmpressure_lock);
+	lowmem_vmpressure_decay();
+	level = lowmem_vmpressure_level;
+	spin_unlock(&lowmem_vmpressure_lock);
+
+	if (level <= 0 || lowmem_swap_reclaimable())
+		return OOM_SCORE_ADJ_MAX + 1;
+	if (level > array_size)
+		level = array_size;
+
+	return lowmem_adj[array_size - level];
+}
+
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
 	struct task_struct *tsk;
 	struct task_struct *selected = NULL;
+	struct rb_node *n, *prev;
+	int scanned = 0;
 	int rem = 0;
 	int tasksize;
 	int i;
@@ -136,13 +355,17 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		minfree = lowmem_minfree[i];
-		if (other_free < minfree && other_file < minfree) {
-			min_score_adj = lowmem_adj[i];
-			break;
+	if (lowmem_vmpressure_mode) {
+		min_score_adj = lowmem_vmpressure_min_adj(array_size);
+	} else {
+		if (lowmem_minfree_size < array_size)
+			array_size = lowmem_minfree_size;
+		for (i = 0; i < array_size; i++) {
+			minfree = lowmem_minfree[i];
+			if (other_free < minfree && other_file < minfree) {
+				min_score_adj = lowmem_adj[i];
+				break;
+			}
 		}
 	}
 	if (sc->nr_to_scan > 0)
@@ -160,13 +383,24 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	}
 	selected_oom_score_adj = min_score_adj;
 
+	/*
+	 * Walk the index from the highest oom_score_adj down. Once a task
+	 * has been selected only the rest of its bucket needs to be looked
+	 * at, the first lower adj ends the walk.
+	 */
 	rcu_read_lock();
-	for_each_process(tsk) {
+	spin_lock(&lowmem_adj_lock);
+	for (n = rb_last(&lowmem_adj_tree); n; n = prev) {
 		struct task_struct *p;
 		int oom_score_adj;
 
-		if (tsk->flags & PF_KTHREAD)
-			continue;
+		prev = rb_prev(n);
+		tsk = rb_entry(n, struct task_struct, adj_node);
+		if (tsk->adj_key < min_score_adj)
+			break;
+		if (selected && tsk->adj_key < selected_oom_score_adj)
+			break;
+		scanned++;
 
 		p = find_lock_task_mm(tsk);
 		if (!p)
@@ -175,7 +409,9 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
 		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
 			task_unlock(p);
+			spin_unlock(&lowmem_adj_lock);
 			rcu_read_unlock();
+			lowmem_tasks_scanned += scanned;
 			return 0;
 		}
 		oom_score_adj = p->signal->oom_score_adj;
@@ -200,6 +436,9 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			lowmem_print_ratelimited(2, "[lmk] the process '%s' is inside the donotkill_proc_names\n", p->comm);
 			lowmem_print_ratelimited(2, "[lmk] set oom_score_adj from %d to %d for (%s)\n", p->signal->oom_score_adj, 0, p->comm);
 			p->signal->oom_score_adj = 0;
+			/* prev stays valid, tsk is only moved within the tree */
+			__lowmem_task_erase(tsk);
+			__lowmem_task_insert(tsk);
 			continue;
 		}
 #endif
@@ -210,31 +449,50 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_print(2, "select '%s' (%d), adj %d, size %d, to kill\n",
 			     p->comm, p->pid, oom_score_adj, tasksize);
 	}
+	spin_unlock(&lowmem_adj_lock);
+	lowmem_tasks_scanned += scanned;
+
 	if (selected) {
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_DO_NOT_KILL_PROCESS
 		if (!is_in_donotkill_proc_list(selected->comm)) {
 #endif
-			lowmem_print(1, "Killing '%s' (%d), adj %d,\n" \
-				"   to free %ldkB on behalf of '%s' (%d) because\n" \
-				"   cache %ldkB is below limit %ldkB for oom_score_adj %d\n" \
-				"   Free memory is %ldkB above reserved\n",
-			     selected->comm, selected->pid,
-			     selected_oom_score_adj,
-			     selected_tasksize * (long)(PAGE_SIZE / 1024),
-			     current->comm, current->pid,
-			     other_file * (long)(PAGE_SIZE / 1024),
-			     minfree * (long)(PAGE_SIZE / 1024),
-			     min_score_adj,
-			     other_free * (long)(PAGE_SIZE / 1024));
+			if (lowmem_vmpressure_mode)
+				lowmem_print(1, "Killing '%s' (%d), adj %d, scanned %d tasks,\n" \
+					"   to free %ldkB on behalf of '%s' (%d) because\n" \
+					"   vmpressure level %d, average pressure %lu allows oom_score_adj %d\n" \
+					"   cache %ldkB, free memory is %ldkB above reserved\n",
+				     selected->comm, selected->pid,
+				     selected_oom_score_adj, scanned,
+				     selected_tasksize * (long)(PAGE_SIZE / 1024),
+				     current->comm, current->pid,
+				     lowmem_vmpressure_level,
+				     lowmem_vmpressure_avg, min_score_adj,
+				     other_file * (long)(PAGE_SIZE / 1024),
+				     other_free * (long)(PAGE_SIZE / 1024));
+			else
+				lowmem_print(1, "Killing '%s' (%d), adj %d, scanned %d tasks,\n" \
+					"   to free %ldkB on behalf of '%s' (%d) because\n" \
+					"   cache %ldkB is below limit %ldkB for oom_score_adj %d\n" \
+					"   Free memory is %ldkB above reserved\n",
+				     selected->comm, selected->pid,
+				     selected_oom_score_adj, scanned,
+				     selected_tasksize * (long)(PAGE_SIZE / 1024),
+				     current->comm, current->pid,
+				     other_file * (long)(PAGE_SIZE / 1024),
+				     minfree * (long)(PAGE_SIZE / 1024),
+				     min_score_adj,
+				     other_free * (long)(PAGE_SIZE / 1024));
 			lowmem_deathpending_timeout = jiffies + HZ;
 			send_sig(SIGKILL, selected, 0);
 			set_tsk_thread_flag(selected, TIF_MEMDIE);
 			rem -= selected_tasksize;
+			lowmem_kill_count++;
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_DO_NOT_KILL_PROCESS
 		} else {
 			lowmem_print(1, "[lmk] the process '%s' is inside the donotkill_proc_names\n", selected->comm);
 			lowmem_print(2, "[lmk] set oom_score_adj from %d to %d for (%s)\n", selected->signal->oom_score_adj, 0, selected->comm);
 			selected->signal->oom_score_adj = 0;
+			lowmem_task_update_adj(selected);
 			rcu_read_unlock();
 			/* give the system time to free up the memory */
 			msleep_interruptible(20);
@@ -258,11 +516,13 @@ static struct shrinker lowmem_shrinker = {
 static int __init lowmem_init(void)
 {
 	register_shrinker(&lowmem_shrinker);
+	vmpressure_notifier_register(&lowmem_vmpressure_nb);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	vmpressure_notifier_unregister(&lowmem_vmpressure_nb);
 	unregister_shrinker(&lowmem_shrinker);
 }
 
@@ -357,6 +617,21 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(tasks_scanned, lowmem_tasks_scanned, uint, S_IRUGO);
+module_param_named(kill_count, lowmem_kill_count, uint, S_IRUGO);
+module_param_named(vmpressure_mode, lowmem_vmpressure_mode, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_critical, lowmem_vmpressure_critical, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_relax, lowmem_vmpressure_relax, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_windows, lowmem_vmpressure_windows, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_swap_reserve, lowmem_vmpressure_swap_reserve,
+		   uint, S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_decay_ms, lowmem_vmpressure_decay_ms, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_level, lowmem_vmpressure_level, int, S_IRUGO);
 
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_DO_NOT_KILL_PROCESS
 module_param_named(donotkill_proc, donotkill_proc.enabled, uint, S_IRUGO | S_IWUSR);
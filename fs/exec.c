@@ -982,6 +982,8 @@ static int de_thread(struct task_struct *tsk)
 		write_unlock_irq(&tasklist_lock);
 		threadgroup_change_end(tsk);
 
+		/* the old leader leaves the lowmemorykiller index in release_task */
+		lowmem_task_add(tsk);
 		release_task(leader);
 	}
 
@@ -90,6 +90,20 @@ static void update_general_status(struct f2fs_sb_info *sbi)
 	}
 
 	si->inplace_count = atomic_read(&sbi->inplace_count);
+
+	if (SM_I(sbi)->dcc_info) {
+		struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+		si->nr_pending_discard = dcc->nr_pending;
+		si->pending_discard_blks = dcc->pending_blks;
+		si->nr_issued_discard = dcc->issued_cmds;
+		si->issued_discard_blks = dcc->issued_blks;
+	} else {
+		si->nr_pending_discard = 0;
+		si->pending_discard_blks = 0;
+		si->nr_issued_discard = 0;
+		si->issued_discard_blks = 0;
+	}
 }
 
 /*
@@ -183,6 +197,13 @@ get_cache:
 	if (SM_I(sbi)->cmd_control_info)
 		si->cache_mem += sizeof(struct flush_cmd_control);
 
+	/* build discard thread */
+	if (SM_I(sbi)->dcc_info) {
+		si->cache_mem += sizeof(struct discard_cmd_control);
+		si->cache_mem += SM_I(sbi)->dcc_info->nr_pending *
+						sizeof(struct discard_cmd);
+	}
+
 	/* free nids */
 	si->cache_mem += NM_I(sbi)->fcnt * sizeof(struct free_nid);
 	si->cache_mem += NM_I(sbi)->nat_cnt * sizeof(struct nat_entry);
@@ -325,6 +346,10 @@ static int stat_show(struct seq_file *s, void *v)
 			   si->block_count[SSR], si->segment_count[SSR]);
 		seq_printf(s, "LFS: %u blocks in %u segments\n",
 			   si->block_count[LFS], si->segment_count[LFS]);
+		seq_printf(s, "Discard: %u pending (%llu blocks), ",
+			   si->nr_pending_discard, si->pending_discard_blks);
+		seq_printf(s, "%u issued (%llu blocks)\n",
+			   si->nr_issued_discard, si->issued_discard_blks);
 
 		/* segment usage info */
 		update_sit_info(si->sbi);
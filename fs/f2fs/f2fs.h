@@ -178,6 +178,13 @@ struct discard_entry {
 	int len;		/* # of consecutive blocks of the discard */
 };
 
+/* for the rb-tree of discards pending in the discard thread */
+struct discard_cmd {
+	struct rb_node rb_node;	/* rb node located in rb-tree */
+	block_t lstart;		/* start block address of the discard */
+	block_t len;		/* # of consecutive blocks of the discard */
+};
+
 /* for the list of fsync inodes, used only during recovery */
 struct fsync_inode_entry {
 	struct list_head list;	/* list head */
@@ -599,6 +606,21 @@ struct flush_cmd_control {
 	struct llist_node *dispatch_list;	/* list for command dispatch */
 };
 
+struct discard_cmd_control {
+	struct task_struct *f2fs_issue_discard;	/* discard thread */
+	wait_queue_head_t discard_wait_queue;	/* waiting queue for wake-up */
+	struct mutex cmd_lock;			/* protects the fields below */
+	struct mutex issue_lock;		/* held while issuing a discard */
+	struct rb_root root;			/* pending discards by address */
+	unsigned int nr_pending;		/* # of pending discards */
+	block_t pending_blks;			/* # of blocks pending discard */
+	block_t issue_start;			/* start of the issuing discard */
+	block_t issue_len;			/* length of the issuing discard */
+	unsigned int discard_granularity;	/* discard granularity in blocks */
+	unsigned int issued_cmds;		/* # of issued discards */
+	unsigned long long issued_blks;		/* # of discarded blocks */
+};
+
 struct f2fs_sm_info {
 	struct sit_info *sit_info;		/* whole segment information */
 	struct free_segmap_info *free_info;	/* free segment information */
@@ -634,6 +656,8 @@ struct f2fs_sm_info {
 	/* for flush command control */
 	struct flush_cmd_control *cmd_control_info;
 
+	/* for background discard control */
+	struct discard_cmd_control *dcc_info;
 };
 
 /*
@@ -1782,6 +1806,8 @@ void f2fs_balance_fs_bg(struct f2fs_sb_info *);
 int f2fs_issue_flush(struct f2fs_sb_info *);
 int create_flush_cmd_control(struct f2fs_sb_info *);
 void destroy_flush_cmd_control(struct f2fs_sb_info *);
+int start_discard_thread(struct f2fs_sb_info *);
+void stop_discard_thread(struct f2fs_sb_info *);
 void invalidate_blocks(struct f2fs_sb_info *, block_t);
 bool is_checkpointed_data(struct f2fs_sb_info *, block_t);
 void refresh_sit_entry(struct f2fs_sb_info *, block_t, block_t);
@@ -1910,6 +1936,8 @@ struct f2fs_stat_info {
 	unsigned int segment_count[2];
 	unsigned int block_count[2];
 	unsigned int inplace_count;
+	unsigned int nr_pending_discard, nr_issued_discard;
+	unsigned long long pending_discard_blks, issued_discard_blks;
 	unsigned long long base_mem, cache_mem, page_mem;
 };
 
@@ -16,16 +16,19 @@
 #include <linux/kthread.h>
 #include <linux/swap.h>
 #include <linux/timer.h>
+#include <linux/freezer.h>
 
 #include "f2fs.h"
 #include "segment.h"
 #include "node.h"
+#include "gc.h"
 #include "trace.h"
 #include <trace/events/f2fs.h>
 
 #define __reverse_ffz(x) __reverse_ffs(~(x))
 
 static struct kmem_cache *discard_entry_slab;
+static struct kmem_cache *discard_cmd_slab;
 static struct kmem_cache *sit_entry_set_slab;
 static struct kmem_cache *inmem_entry_slab;
 
@@ -579,11 +582,9 @@ static void locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno)
 	mutex_unlock(&dirty_i->seglist_lock);
 }
 
-static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
+static void __set_discard_map(struct f2fs_sb_info *sbi,
 				block_t blkstart, block_t blklen)
 {
-	sector_t start = SECTOR_FROM_BLOCK(blkstart);
-	sector_t len = SECTOR_FROM_BLOCK(blklen);
 	struct seg_entry *se;
 	unsigned int offset;
 	block_t i;
@@ -595,10 +596,354 @@ static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
 		if (!f2fs_test_and_set_bit(offset, se->discard_map))
 			sbi->discard_blks--;
 	}
+}
+
+static int __issue_discard(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	sector_t start = SECTOR_FROM_BLOCK(blkstart);
+	sector_t len = SECTOR_FROM_BLOCK(blklen);
+
 	trace_f2fs_issue_discard(sbi->sb, blkstart, blklen);
 	return blkdev_issue_discard(sbi->sb->s_bdev, start, len, GFP_NOFS, 0);
 }
 
+static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	__set_discard_map(sbi, blkstart, blklen);
+	return __issue_discard(sbi, blkstart, blklen);
+}
+
+static struct discard_cmd *__lookup_discard_cmd(
+			struct discard_cmd_control *dcc, block_t blkaddr)
+{
+	struct rb_node *node = dcc->root.rb_node;
+	struct discard_cmd *dc;
+
+	while (node) {
+		dc = rb_entry(node, struct discard_cmd, rb_node);
+
+		if (blkaddr < dc->lstart)
+			node = node->rb_left;
+		else if (blkaddr >= dc->lstart + dc->len)
+			node = node->rb_right;
+		else
+			return dc;
+	}
+	return NULL;
+}
+
+static void __remove_discard_cmd(struct discard_cmd_control *dcc,
+						struct discard_cmd *dc)
+{
+	rb_erase(&dc->rb_node, &dcc->root);
+	dcc->nr_pending--;
+	dcc->pending_blks -= dc->len;
+	kmem_cache_free(discard_cmd_slab, dc);
+}
+
+/*
+ * Pending discards never overlap nor touch each other: a new range that
+ * touches existing ones is merged with all of them into a single entry.
+ */
+static void __insert_discard_cmd(struct discard_cmd_control *dcc,
+						block_t lstart, block_t len)
+{
+	struct rb_node **p = &dcc->root.rb_node;
+	struct rb_node *parent = NULL, *node;
+	struct discard_cmd *dc, *t;
+	block_t end = lstart + len;
+
+	while (*p) {
+		parent = *p;
+		dc = rb_entry(parent, struct discard_cmd, rb_node);
+
+		if (end < dc->lstart)
+			p = &(*p)->rb_left;
+		else if (lstart > dc->lstart + dc->len)
+			p = &(*p)->rb_right;
+		else
+			goto merge;
+	}
+
+	dc = f2fs_kmem_cache_alloc(discard_cmd_slab, GFP_NOFS);
+	dc->lstart = lstart;
+	dc->len = len;
+	rb_link_node(&dc->rb_node, parent, p);
+	rb_insert_color(&dc->rb_node, &dcc->root);
+	dcc->nr_pending++;
+	dcc->pending_blks += len;
+	return;
+merge:
+	dcc->pending_blks -= dc->len;
+	end = max(end, dc->lstart + dc->len);
+	dc->lstart = min(lstart, dc->lstart);
+
+	while ((node = rb_prev(&dc->rb_node))) {
+		t = rb_entry(node, struct discard_cmd, rb_node);
+		if (t->lstart + t->len < dc->lstart)
+			break;
+		dc->lstart = min(dc->lstart, t->lstart);
+		__remove_discard_cmd(dcc, t);
+	}
+	while ((node = rb_next(&dc->rb_node))) {
+		t = rb_entry(node, struct discard_cmd, rb_node);
+		if (t->lstart > end)
+			break;
+		end = max(end, t->lstart + t->len);
+		__remove_discard_cmd(dcc, t);
+	}
+	dc->len = end - dc->lstart;
+	dcc->pending_blks += dc->len;
+}
+
+/*
+ * Queue a discard to the discard thread, or issue it right away if there
+ * is none. The blocks are accounted as discarded from now on.
+ */
+static void f2fs_queue_discard(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	bool queued;
+
+	__set_discard_map(sbi, blkstart, blklen);
+
+	mutex_lock(&dcc->cmd_lock);
+	queued = dcc->f2fs_issue_discard != NULL;
+	if (queued)
+		__insert_discard_cmd(dcc, blkstart, blklen);
+	mutex_unlock(&dcc->cmd_lock);
+
+	if (queued)
+		wake_up(&dcc->discard_wait_queue);
+	else
+		__issue_discard(sbi, blkstart, blklen);
+}
+
+/*
+ * A block which is about to be reused must not be discarded afterwards.
+ * Cut it out of the pending discards and wait for the discard covering it
+ * if that is being issued. Returns true if the block was still pending,
+ * i.e. it has not been discarded yet.
+ */
+static bool __drop_discard_cmd(struct f2fs_sb_info *sbi, block_t blkaddr)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct discard_cmd *dc;
+	bool pending = false, issuing;
+
+	/*
+	 * Most allocations hit blocks that were discarded long ago. Pairs
+	 * with the barrier in __issue_discard_cmd(), a range leaves the tree
+	 * only after it has been published as issuing.
+	 */
+	if (!ACCESS_ONCE(dcc->nr_pending)) {
+		smp_rmb();
+		if (!ACCESS_ONCE(dcc->issue_len))
+			return false;
+	}
+
+	mutex_lock(&dcc->cmd_lock);
+	dc = __lookup_discard_cmd(dcc, blkaddr);
+	if (dc) {
+		block_t end = dc->lstart + dc->len;
+
+		pending = true;
+		if (dc->len == 1) {
+			__remove_discard_cmd(dcc, dc);
+		} else if (blkaddr == dc->lstart) {
+			dc->lstart++;
+			dc->len--;
+			dcc->pending_blks--;
+		} else if (blkaddr == end - 1) {
+			dc->len--;
+			dcc->pending_blks--;
+		} else {
+			dcc->pending_blks -= end - blkaddr;
+			dc->len = blkaddr - dc->lstart;
+			__insert_discard_cmd(dcc, blkaddr + 1, end - blkaddr - 1);
+		}
+	}
+	issuing = dcc->issue_len && blkaddr >= dcc->issue_start &&
+			blkaddr < dcc->issue_start + dcc->issue_len;
+	mutex_unlock(&dcc->cmd_lock);
+
+	if (issuing) {
+		mutex_lock(&dcc->issue_lock);
+		mutex_unlock(&dcc->issue_lock);
+	}
+	return pending;
+}
+
+/*
+ * Issue the lowest pending range in chunks of at most a segment, split at
+ * the discard granularity of the device so that the bulk of a range goes
+ * out in whole granules. The unaligned head and a tail shorter than a
+ * granule are still issued on their own, their blocks are accounted as
+ * discarded already. Returns the # of blocks issued, 0 if nothing is left.
+ */
+static block_t __issue_discard_cmd(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	unsigned int gran = dcc->discard_granularity;
+	block_t max_len = max(gran, rounddown(sbi->blocks_per_seg, gran));
+	block_t start = 0, len = 0;
+	struct rb_node *node;
+
+	mutex_lock(&dcc->issue_lock);
+	mutex_lock(&dcc->cmd_lock);
+	node = rb_first(&dcc->root);
+	if (node) {
+		struct discard_cmd *dc = rb_entry(node, struct discard_cmd,
+								rb_node);
+		block_t end = dc->lstart + dc->len;
+		block_t aligned = roundup(dc->lstart, gran);
+
+		start = dc->lstart;
+		if (aligned > start)
+			len = min(aligned, end) - start;
+		else if (dc->len >= gran)
+			len = min(rounddown(dc->len, gran), max_len);
+		else
+			len = dc->len;
+
+		dcc->issue_start = start;
+		dcc->issue_len = len;
+		smp_wmb();
+		if (start + len == end) {
+			__remove_discard_cmd(dcc, dc);
+		} else {
+			dc->lstart += len;
+			dc->len -= len;
+			dcc->pending_blks -= len;
+		}
+	}
+	mutex_unlock(&dcc->cmd_lock);
+
+	if (len) {
+		__issue_discard(sbi, start, len);
+
+		mutex_lock(&dcc->cmd_lock);
+		dcc->issue_len = 0;
+		dcc->issued_cmds++;
+		dcc->issued_blks += len;
+		mutex_unlock(&dcc->cmd_lock);
+	}
+	mutex_unlock(&dcc->issue_lock);
+
+	return len;
+}
+
+static int issue_discard_thread(void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	wait_queue_head_t *q = &dcc->discard_wait_queue;
+	int i;
+
+	set_freezable();
+
+	do {
+		if (try_to_freeze())
+			continue;
+		else if (!dcc->nr_pending)
+			wait_event_interruptible(*q,
+				kthread_should_stop() || dcc->nr_pending);
+		else
+			wait_event_interruptible_timeout(*q,
+				kthread_should_stop(),
+				msecs_to_jiffies(DEF_DISCARD_SLEEP_TIME));
+		if (kthread_should_stop())
+			break;
+
+		if (sbi->sb->s_frozen >= SB_FREEZE_WRITE)
+			continue;
+
+		/* discards go out in address order while nobody else waits */
+		for (i = 0; i < DEF_DISCARD_BATCH; i++) {
+			if (!is_idle(sbi) &&
+				dcc->nr_pending < DEF_MAX_PENDING_DISCARDS)
+				break;
+			if (!__issue_discard_cmd(sbi))
+				break;
+		}
+	} while (!kthread_should_stop());
+	return 0;
+}
+
+int start_discard_thread(struct f2fs_sb_info *sbi)
+{
+	dev_t dev = sbi->sb->s_bdev->bd_dev;
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct task_struct *task;
+
+	task = kthread_run(issue_discard_thread, sbi,
+			"f2fs_discard-%u:%u", MAJOR(dev), MINOR(dev));
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	mutex_lock(&dcc->cmd_lock);
+	dcc->f2fs_issue_discard = task;
+	mutex_unlock(&dcc->cmd_lock);
+	return 0;
+}
+
+/*
+ * Discards are issued synchronously again from now on. What is pending
+ * is accounted as discarded already, so flush it before returning.
+ */
+void stop_discard_thread(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct task_struct *task;
+
+	mutex_lock(&dcc->cmd_lock);
+	task = dcc->f2fs_issue_discard;
+	dcc->f2fs_issue_discard = NULL;
+	mutex_unlock(&dcc->cmd_lock);
+
+	if (task)
+		kthread_stop(task);
+
+	while (__issue_discard_cmd(sbi))
+		;
+}
+
+/*
+ * The control stays around for the whole mount, remount only starts and
+ * stops the thread, so that the allocation path can use it unlocked.
+ */
+static int create_discard_cmd_control(struct f2fs_sb_info *sbi)
+{
+	struct request_queue *q = bdev_get_queue(sbi->sb->s_bdev);
+	struct discard_cmd_control *dcc;
+
+	dcc = kzalloc(sizeof(struct discard_cmd_control), GFP_KERNEL);
+	if (!dcc)
+		return -ENOMEM;
+	init_waitqueue_head(&dcc->discard_wait_queue);
+	mutex_init(&dcc->cmd_lock);
+	mutex_init(&dcc->issue_lock);
+	dcc->root = RB_ROOT;
+	dcc->discard_granularity = max_t(unsigned int, 1,
+			q->limits.discard_granularity >> sbi->log_blocksize);
+	SM_I(sbi)->dcc_info = dcc;
+	return 0;
+}
+
+static void destroy_discard_cmd_control(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+	if (!dcc)
+		return;
+	stop_discard_thread(sbi);
+	kfree(dcc);
+	SM_I(sbi)->dcc_info = NULL;
+}
+
 bool discard_next_dnode(struct f2fs_sb_info *sbi, block_t blkaddr)
 {
 	int err = -ENOTSUPP;
@@ -608,7 +953,8 @@ bool discard_next_dnode(struct f2fs_sb_info *sbi, block_t blkaddr)
 				GET_SEGNO(sbi, blkaddr));
 		unsigned int offset = GET_BLKOFF_FROM_SEG0(sbi, blkaddr);
 
-		if (f2fs_test_bit(offset, se->discard_map))
+		if (f2fs_test_bit(offset, se->discard_map) &&
+				!__drop_discard_cmd(sbi, blkaddr))
 			return false;
 
 		err = f2fs_issue_discard(sbi, blkaddr, 1);
@@ -735,7 +1081,11 @@ void clear_prefree_segments(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 		if (!test_opt(sbi, DISCARD))
 			continue;
 
-		f2fs_issue_discard(sbi, START_BLOCK(sbi, start),
+		if (cpc->reason == CP_DISCARD)
+			f2fs_issue_discard(sbi, START_BLOCK(sbi, start),
+				(end - start) << sbi->log_blocks_per_seg);
+		else
+			f2fs_queue_discard(sbi, START_BLOCK(sbi, start),
 				(end - start) << sbi->log_blocks_per_seg);
 	}
 	mutex_unlock(&dirty_i->seglist_lock);
@@ -744,7 +1094,10 @@ void clear_prefree_segments(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	list_for_each_entry_safe(entry, this, head, list) {
 		if (cpc->reason == CP_DISCARD && entry->len < cpc->trim_minlen)
 			goto skip;
-		f2fs_issue_discard(sbi, entry->blkaddr, entry->len);
+		if (cpc->reason == CP_DISCARD)
+			f2fs_issue_discard(sbi, entry->blkaddr, entry->len);
+		else
+			f2fs_queue_discard(sbi, entry->blkaddr, entry->len);
 		cpc->trimmed += entry->len;
 skip:
 		list_del(&entry->list);
@@ -799,6 +1152,8 @@ static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del)
 			f2fs_bug_on(sbi, 1);
 		if (!f2fs_test_and_set_bit(offset, se->discard_map))
 			sbi->discard_blks--;
+		else
+			__drop_discard_cmd(sbi, blkaddr);
 	} else {
 		if (!f2fs_test_and_clear_bit(offset, se->cur_valid_map))
 			f2fs_bug_on(sbi, 1);
@@ -2405,6 +2760,16 @@ int build_segment_manager(struct f2fs_sb_info *sbi)
 			return err;
 	}
 
+	err = create_discard_cmd_control(sbi);
+	if (err)
+		return err;
+
+	if (test_opt(sbi, DISCARD) && !f2fs_readonly(sbi->sb)) {
+		err = start_discard_thread(sbi);
+		if (err)
+			return err;
+	}
+
 	err = build_sit_info(sbi);
 	if (err)
 		return err;
@@ -2518,6 +2883,7 @@ void destroy_segment_manager(struct f2fs_sb_info *sbi)
 	if (!sm_info)
 		return;
 	destroy_flush_cmd_control(sbi);
+	destroy_discard_cmd_control(sbi);
 	destroy_dirty_segmap(sbi);
 	destroy_curseg(sbi);
 	destroy_free_segmap(sbi);
@@ -2533,10 +2899,15 @@ int __init create_segment_manager_caches(void)
 	if (!discard_entry_slab)
 		goto fail;
 
+	discard_cmd_slab = f2fs_kmem_cache_create("discard_cmd",
+			sizeof(struct discard_cmd));
+	if (!discard_cmd_slab)
+		goto destory_discard_entry;
+
 	sit_entry_set_slab = f2fs_kmem_cache_create("sit_entry_set",
 			sizeof(struct sit_entry_set));
 	if (!sit_entry_set_slab)
-		goto destory_discard_entry;
+		goto destroy_discard_cmd;
 
 	inmem_entry_slab = f2fs_kmem_cache_create("inmem_page_entry",
 			sizeof(struct inmem_pages));
@@ -2546,6 +2917,8 @@ int __init create_segment_manager_caches(void)
 
 destroy_sit_entry_set:
 	kmem_cache_destroy(sit_entry_set_slab);
+destroy_discard_cmd:
+	kmem_cache_destroy(discard_cmd_slab);
 destory_discard_entry:
 	kmem_cache_destroy(discard_entry_slab);
 fail:
@@ -2555,6 +2928,7 @@ fail:
 void destroy_segment_manager_caches(void)
 {
 	kmem_cache_destroy(sit_entry_set_slab);
+	kmem_cache_destroy(discard_cmd_slab);
 	kmem_cache_destroy(discard_entry_slab);
 	kmem_cache_destroy(inmem_entry_slab);
 }
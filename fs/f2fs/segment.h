@@ -509,6 +509,15 @@ static inline int utilization(struct f2fs_sb_info *sbi)
 #define DEF_MIN_IPU_UTIL	70
 #define DEF_MIN_FSYNC_BLOCKS	8
 
+/*
+ * The discard thread issues pending discards only while the device is idle,
+ * at most DEF_DISCARD_BATCH in a row before re-checking, unless more than
+ * DEF_MAX_PENDING_DISCARDS ranges have piled up.
+ */
+#define DEF_DISCARD_SLEEP_TIME		50	/* milliseconds */
+#define DEF_DISCARD_BATCH		16
+#define DEF_MAX_PENDING_DISCARDS	4096
+
 enum {
 	F2FS_IPU_FORCE,
 	F2FS_IPU_SSR,
@@ -748,6 +748,8 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 	int err, active_logs;
 	bool need_restart_gc = false;
 	bool need_stop_gc = false;
+	bool need_restart_discard = false;
+	bool need_stop_discard = false;
 	bool no_extent_cache = !test_opt(sbi, EXTENT_CACHE);
 
 	sync_filesystem(sb);
@@ -800,6 +802,22 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 		need_stop_gc = true;
 	}
 
+	/*
+	 * We stop issue discard thread if FS is mounted as RO
+	 * or if discard is not passed in mount option.
+	 */
+	if ((*flags & MS_RDONLY) || !test_opt(sbi, DISCARD)) {
+		if (SM_I(sbi)->dcc_info->f2fs_issue_discard) {
+			stop_discard_thread(sbi);
+			need_restart_discard = true;
+		}
+	} else if (!SM_I(sbi)->dcc_info->f2fs_issue_discard) {
+		err = start_discard_thread(sbi);
+		if (err)
+			goto restore_gc;
+		need_stop_discard = true;
+	}
+
 	/*
 	 * We stop issue flush thread if FS is mounted as RO
 	 * or if flush_merge is not passed in mount option.
@@ -809,13 +827,21 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 	} else if (!SM_I(sbi)->cmd_control_info) {
 		err = create_flush_cmd_control(sbi);
 		if (err)
-			goto restore_gc;
+			goto restore_discard;
 	}
 skip:
 	/* Update the POSIXACL Flag */
 	 sb->s_flags = (sb->s_flags & ~MS_POSIXACL) |
 		(test_opt(sbi, POSIX_ACL) ? MS_POSIXACL : 0);
 	return 0;
+restore_discard:
+	if (need_restart_discard) {
+		if (start_discard_thread(sbi))
+			f2fs_msg(sbi->sb, KERN_WARNING,
+				"discard thread has stopped");
+	} else if (need_stop_discard) {
+		stop_discard_thread(sbi);
+	}
 restore_gc:
 	if (need_restart_gc) {
 		if (start_gc_thread(sbi))
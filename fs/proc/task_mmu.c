@@ -1115,6 +1115,7 @@ cont:
 	isolated = 0;
 	pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
 	for (; addr != end; pte++, addr += PAGE_SIZE) {
+		rp->nr_scanned++;
 		ptent = *pte;
 		if (!pte_present(ptent))
 			continue;
@@ -1123,6 +1124,16 @@ cont:
 		if (!page)
 			continue;
 
+		if (rp->skip_referenced) {
+			int young;
+
+			/* the TLB is flushed once the whole walk is done */
+			young = ptep_test_and_clear_young(vma, addr, pte);
+			young |= TestClearPageReferenced(page);
+			if (young || rp->age_only)
+				continue;
+		}
+
 		if (isolate_lru_page(page))
 			continue;
 
@@ -1130,9 +1141,12 @@ cont:
 		inc_zone_page_state(page, NR_ISOLATED_ANON +
 				page_is_file_cache(page));
 		isolated++;
-		rp->nr_scanned++;
-		if ((isolated >= SWAP_CLUSTER_MAX) || !rp->nr_to_reclaim)
+		if ((isolated >= SWAP_CLUSTER_MAX) || !rp->nr_to_reclaim) {
+			/* resume past this pte so it is not scanned twice */
+			pte++;
+			addr += PAGE_SIZE;
 			break;
+		}
 	}
 	pte_unmap_unlock(pte - 1, ptl);
 	reclaimed = reclaim_pages_from_list(&page_list, vma);
@@ -1165,6 +1179,8 @@ struct reclaim_param reclaim_task_anon(struct task_struct *task,
 
 	rp.nr_reclaimed = 0;
 	rp.nr_scanned = 0;
+	rp.skip_referenced = false;
+	rp.age_only = false;
 	get_task_struct(task);
 	mm = get_task_mm(task);
 	if (!mm)
@@ -1200,18 +1216,84 @@ out:
 	return rp;
 }
 
+/* Result of the last write, read back through the same file */
+struct reclaim_result {
+	int nr_reclaimed;
+	int nr_scanned;
+};
+
+static int reclaim_open(struct inode *inode, struct file *file)
+{
+	file->private_data = kzalloc(sizeof(struct reclaim_result),
+				     GFP_KERNEL);
+	if (!file->private_data)
+		return -ENOMEM;
+	return 0;
+}
+
+static int reclaim_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t reclaim_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct reclaim_result *result = file->private_data;
+	char buffer[64];
+	size_t len;
+
+	len = snprintf(buffer, sizeof(buffer), "reclaimed %d scanned %d\n",
+		       result->nr_reclaimed, result->nr_scanned);
+	return simple_read_from_buffer(buf, count, ppos, buffer, len);
+}
+
+/*
+ * There is no per-page access time to compare against, so the age is
+ * tracked with the accessed bits: a pass clears them and records the
+ * time in mm->reclaim_stamp. Once @age seconds have passed, a page
+ * whose bit is still clear has not been touched for at least that long
+ * and may be reclaimed. Earlier passes must leave the bits alone or
+ * pages used in between would look idle.
+ */
+static void reclaim_set_age(struct mm_struct *mm, unsigned int age,
+			    struct reclaim_param *rp)
+{
+	unsigned long now = jiffies;
+	unsigned long age_jiffies;
+
+	/* keep the period within what time_before() can compare */
+	age_jiffies = min_t(unsigned long, age, MAX_JIFFY_OFFSET / HZ) * HZ;
+
+	rp->skip_referenced = true;
+	if (!mm->reclaim_stamp) {
+		rp->age_only = true;
+		mm->reclaim_stamp = now;
+	} else if (time_before(now, mm->reclaim_stamp + age_jiffies)) {
+		rp->age_only = true;
+		rp->nr_to_reclaim = 0;
+	} else {
+		rp->age_only = false;
+		mm->reclaim_stamp = now;
+	}
+}
+
 static ssize_t reclaim_write(struct file *file, const char __user *buf,
 				size_t count, loff_t *ppos)
 {
+	struct reclaim_result *result = file->private_data;
 	struct task_struct *task;
 	char buffer[200];
 	struct mm_struct *mm;
 	struct vm_area_struct *vma;
 	enum reclaim_type type;
-	char *type_buf;
+	char *type_buf, *age_buf;
 	struct mm_walk reclaim_walk = {};
 	unsigned long start = 0;
 	unsigned long end = 0;
+	unsigned int age = 0;
+	bool aged = false;
 	struct reclaim_param rp;
 
 	memset(buffer, 0, sizeof(buffer));
@@ -1222,6 +1304,14 @@ static ssize_t reclaim_write(struct file *file, const char __user *buf,
 		return -EFAULT;
 
 	type_buf = strstrip(buffer);
+	age_buf = strstr(type_buf, " age=");
+	if (age_buf) {
+		*age_buf = '\0';
+		if (kstrtouint(age_buf + 5, 10, &age))
+			goto out_err;
+		aged = true;
+		type_buf = strstrip(type_buf);
+	}
 	if (!strcmp(type_buf, "file"))
 		type = RECLAIM_FILE;
 	else if (!strcmp(type_buf, "anon"))
@@ -1274,15 +1364,22 @@ static ssize_t reclaim_write(struct file *file, const char __user *buf,
 	reclaim_walk.mm = mm;
 	reclaim_walk.pmd_entry = reclaim_pte_range;
 
-	rp.nr_to_reclaim = ~0;
+	rp.nr_to_reclaim = INT_MAX;
 	rp.nr_reclaimed = 0;
+	rp.nr_scanned = 0;
+	rp.skip_referenced = false;
+	rp.age_only = false;
 	reclaim_walk.private = &rp;
 
 	down_read(&mm->mmap_sem);
+	if (aged)
+		reclaim_set_age(mm, age, &rp);
+	if (!rp.nr_to_reclaim)
+		goto out_unlock;
+
 	if (type == RECLAIM_RANGE) {
-		vma = find_vma(mm, start);
-		while (vma) {
-			if (vma->vm_start > end)
+		for (vma = find_vma(mm, start); vma; vma = vma->vm_next) {
+			if (vma->vm_start >= end)
 				break;
 			if (is_vm_hugetlb_page(vma))
 				continue;
@@ -1291,7 +1388,6 @@ static ssize_t reclaim_write(struct file *file, const char __user *buf,
 			walk_page_range(max(vma->vm_start, start),
 					min(vma->vm_end, end),
 					&reclaim_walk);
-			vma = vma->vm_next;
 		}
 	} else {
 		for (vma = mm->mmap; vma; vma = vma->vm_next) {
@@ -1311,8 +1407,11 @@ static ssize_t reclaim_write(struct file *file, const char __user *buf,
 	}
 
 	flush_tlb_mm(mm);
+out_unlock:
 	up_read(&mm->mmap_sem);
 	mmput(mm);
+	result->nr_reclaimed = rp.nr_reclaimed;
+	result->nr_scanned = rp.nr_scanned;
 out:
 	put_task_struct(task);
 	return count;
@@ -1322,7 +1421,10 @@ out_err:
 }
 
 const struct file_operations proc_reclaim_operations = {
+	.open		= reclaim_open,
+	.read		= reclaim_read,
 	.write		= reclaim_write,
+	.release	= reclaim_release,
 	.llseek		= noop_llseek,
 };
 #endif
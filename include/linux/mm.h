@@ -1667,6 +1667,10 @@ struct reclaim_param {
 	int nr_to_reclaim;
 	/* pages reclaimed */
 	int nr_reclaimed;
+	/* skip pages referenced since the accessed bits were last cleared */
+	bool skip_referenced;
+	/* only clear the accessed bits, reclaim nothing */
+	bool age_only;
 };
 extern struct reclaim_param reclaim_task_anon(struct task_struct *task,
 		int nr_to_reclaim);
@@ -393,6 +393,10 @@ struct mm_struct {
 #ifdef CONFIG_CPUMASK_OFFSTACK
 	struct cpumask cpumask_allocation;
 #endif
+#ifdef CONFIG_PROCESS_RECLAIM
+	/* jiffies when the accessed bits were last cleared for reclaim */
+	unsigned long reclaim_stamp;
+#endif
 };
 
 static inline void mm_init_cpumask(struct mm_struct *mm)
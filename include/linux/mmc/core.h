@@ -10,6 +10,7 @@
 
 #include <linux/interrupt.h>
 #include <linux/device.h>
+#include <linux/ktime.h>
 
 struct request;
 struct mmc_data;
@@ -128,6 +129,13 @@ struct mmc_request {
 
 	struct completion	completion;
 	void			(*done)(struct mmc_request *);/* completion function */
+
+	/* latency accounting of async requests, see mmc_start_req() */
+	ktime_t			pre_time;	/* handed to mmc_start_req() */
+	ktime_t			start_time;	/* handed to the host driver */
+	ktime_t			done_time;	/* completed by the host driver */
+	s64			map_ns;		/* DMA (un)mapping in pre/post_req */
+	s64			host_map_ns;	/* DMA (un)mapping while running */
 };
 
 struct mmc_host;
@@ -143,6 +151,7 @@ extern int mmc_app_cmd(struct mmc_host *, struct mmc_card *);
 extern int mmc_wait_for_app_cmd(struct mmc_host *, struct mmc_card *,
 	struct mmc_command *, int);
 extern int mmc_switch(struct mmc_card *, u8, u8, u8, unsigned int);
+extern int mmc_send_ext_csd(struct mmc_card *card, u8 *ext_csd);
 
 #define MMC_ERASE_ARG		0x00000000
 #define MMC_SECURE_ERASE_ARG	0x80000000
@@ -153,6 +153,7 @@ struct mmc_host_ops {
 };
 
 struct mmc_card;
+struct mmc_latency_hist;
 struct device;
 
 struct mmc_async_req {
@@ -253,6 +254,7 @@ struct mmc_host {
 #define MMC_CAP2_BROKEN_VOLTAGE	(1 << 7)	/* Use the broken voltage */
 #define MMC_CAP2_DETECT_ON_ERR	(1 << 8)	/* On I/O err check card removal */
 #define MMC_CAP2_HC_ERASE_SZ	(1 << 9)	/* High-capacity erase size */
+#define MMC_CAP2_PACKED_WR	(1 << 10)	/* Allow packed write */
 #define MMC_CAP2_SECURE_ERASE_EN (1 << 31)	
 
 	mmc_pm_flag_t		pm_caps;	/* supported pm features */
@@ -333,6 +335,7 @@ struct mmc_host {
 	bool			abort_req;
 
 	struct dentry		*debugfs_root;
+	struct mmc_latency_hist	*latency_hist;	/* request latency, debugfs */
 
 	struct mmc_async_req	*areq;		/* active async req */
 
@@ -447,6 +450,11 @@ static inline int mmc_host_cmd23(struct mmc_host *host)
 	return host->caps & MMC_CAP_CMD23;
 }
 
+static inline int mmc_host_packed_wr(struct mmc_host *host)
+{
+	return host->caps2 & MMC_CAP2_PACKED_WR;
+}
+
 static inline int mmc_boot_partition_access(struct mmc_host *host)
 {
 	return !(host->caps2 & MMC_CAP2_BOOTPART_NOACC);
@@ -67,6 +67,33 @@ static inline void oom_killer_enable(void)
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+static inline void lowmem_task_init(struct task_struct *task)
+{
+	RB_CLEAR_NODE(&task->adj_node);
+}
+
+extern void lowmem_task_add(struct task_struct *task);
+extern void lowmem_task_del(struct task_struct *task);
+extern void lowmem_task_update_adj(struct task_struct *task);
+#else
+static inline void lowmem_task_init(struct task_struct *task)
+{
+}
+
+static inline void lowmem_task_add(struct task_struct *task)
+{
+}
+
+static inline void lowmem_task_del(struct task_struct *task)
+{
+}
+
+static inline void lowmem_task_update_adj(struct task_struct *task)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
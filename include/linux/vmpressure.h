@@ -2,8 +2,10 @@
 #define __LINUX_VMPRESSURE_H
 
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
 #include <linux/list.h>
 #include <linux/workqueue.h>
+#include <linux/timer.h>
 #include <linux/gfp.h>
 #include <linux/types.h>
 #include <linux/cgroup.h>
@@ -20,18 +22,44 @@ struct vmpressure {
 	struct mutex events_lock;
 
 	struct work_struct work;
+
+	/*
+	 * Stall time: how much of the wall time tasks were waiting on direct
+	 * reclaim or swap-in, see vmpressure_stall_begin(). It accumulates
+	 * per cpu, stall_timer folds it in at the end of every window.
+	 */
+	struct vmpressure_stall_cpu __percpu *stall_cpu;
+	spinlock_t stall_lock;
+	struct timer_list stall_timer;
+	u64 stall_window_start;
+	/* ns stalled up to the last completed window */
+	u64 stall_total;
+	unsigned int stall_window_ms;
+	/* Stall percentage of the last completed window */
+	unsigned int stall_pct;
+	/* The list of vmpressure_stall_event structs, under events_lock. */
+	struct list_head stall_events;
+	struct work_struct stall_work;
 };
 
 struct mem_cgroup;
 
+/* Filled in by vmpressure_stall_begin(), for vmpressure_stall_end() */
+struct vmpressure_stall {
+	struct mem_cgroup *memcg;
+	int cpu;
+};
+
 extern int vmpressure_notifier_register(struct notifier_block *nb);
 extern int vmpressure_notifier_unregister(struct notifier_block *nb);
 extern void vmpressure(gfp_t gfp, struct mem_cgroup *memcg,
 		       unsigned long scanned, unsigned long reclaimed);
 extern void vmpressure_prio(gfp_t gfp, struct mem_cgroup *memcg, int prio);
+extern void vmpressure_stall_begin(struct vmpressure_stall *stall);
+extern void vmpressure_stall_end(struct vmpressure_stall *stall);
 
 #ifdef CONFIG_CGROUP_MEM_RES_CTLR
-extern void vmpressure_init(struct vmpressure *vmpr);
+extern int vmpressure_init(struct vmpressure *vmpr);
 extern struct vmpressure *memcg_to_vmpressure(struct mem_cgroup *memcg);
 extern struct cgroup_subsys_state *vmpressure_to_css(struct vmpressure *vmpr);
 extern struct vmpressure *css_to_vmpressure(struct cgroup_subsys_state *css);
@@ -40,6 +68,18 @@ extern int vmpressure_register_event(struct cgroup *cg, struct cftype *cft,
 				     const char *args);
 extern void vmpressure_unregister_event(struct cgroup *cg, struct cftype *cft,
 					struct eventfd_ctx *eventfd);
+extern void vmpressure_cleanup(struct vmpressure *vmpr);
+extern int vmpressure_stall_read_map(struct cgroup *cg, struct cftype *cft,
+				     struct cgroup_map_cb *cb);
+extern int vmpressure_stall_window_write(struct cgroup *cg, struct cftype *cft,
+					 u64 val);
+extern int vmpressure_stall_register_event(struct cgroup *cg,
+					   struct cftype *cft,
+					   struct eventfd_ctx *eventfd,
+					   const char *args);
+extern void vmpressure_stall_unregister_event(struct cgroup *cg,
+					      struct cftype *cft,
+					      struct eventfd_ctx *eventfd);
 #else
 static inline struct vmpressure *memcg_to_vmpressure(struct mem_cgroup *memcg)
 {
@@ -21,6 +21,7 @@
 #include <linux/tracepoint.h>
 #include <linux/mmc/mmc.h>
 #include <linux/mmc/core.h>
+#include <linux/mmc/host.h>
 
 /*
  * Unconditional logging of mmc block erase operations,
@@ -85,6 +86,106 @@ DEFINE_EVENT_CONDITION(mmc_blk_rw_class, mmc_blk_rw_end,
 	TP_CONDITION(((cmd == MMC_READ_MULTIPLE_BLOCK) ||
 		      (cmd == MMC_WRITE_MULTIPLE_BLOCK)) &&
 		      data));
+/*
+ * Logging of every request handed to a host driver
+ */
+TRACE_EVENT(mmc_request_start,
+	TP_PROTO(struct mmc_host *host, struct mmc_request *mrq),
+	TP_ARGS(host, mrq),
+	TP_STRUCT__entry(
+		__string(name, mmc_hostname(host))
+		__field(unsigned int, cmd)
+		__field(unsigned int, arg)
+		__field(unsigned int, blocks)
+		__field(unsigned int, flags)
+	),
+	TP_fast_assign(
+		__assign_str(name, mmc_hostname(host));
+		__entry->cmd = mrq->cmd->opcode;
+		__entry->arg = mrq->cmd->arg;
+		__entry->blocks = mrq->data ? mrq->data->blocks : 0;
+		__entry->flags = mrq->data ? mrq->data->flags : 0;
+	),
+	TP_printk("%s: cmd=%u,arg=0x%08x,blocks=%u,%s",
+		  __get_str(name), __entry->cmd, __entry->arg, __entry->blocks,
+		  __entry->flags & MMC_DATA_WRITE ? "write" :
+		  __entry->flags & MMC_DATA_READ ? "read" : "none")
+);
+
+/*
+ * Completion of an async data request, with the time spent mapping
+ * it for DMA, on the bus and waiting for the card to leave busy,
+ * and the total from mmc_start_req() to the end of the status check.
+ */
+TRACE_EVENT(mmc_request_done,
+	TP_PROTO(struct mmc_host *host, struct mmc_request *mrq,
+		 s64 map_us, s64 xfer_us, s64 busy_us, s64 total_us),
+	TP_ARGS(host, mrq, map_us, xfer_us, busy_us, total_us),
+	TP_STRUCT__entry(
+		__string(name, mmc_hostname(host))
+		__field(unsigned int, cmd)
+		__field(unsigned int, blocks)
+		__field(int, error)
+		__field(s64, map_us)
+		__field(s64, xfer_us)
+		__field(s64, busy_us)
+		__field(s64, total_us)
+	),
+	TP_fast_assign(
+		__assign_str(name, mmc_hostname(host));
+		__entry->cmd = mrq->cmd->opcode;
+		__entry->blocks = mrq->data->blocks;
+		__entry->error = mrq->cmd->error ? mrq->cmd->error :
+				 mrq->data->error;
+		__entry->map_us = map_us;
+		__entry->xfer_us = xfer_us;
+		__entry->busy_us = busy_us;
+		__entry->total_us = total_us;
+	),
+	TP_printk("%s: cmd=%u,blocks=%u,err=%d,map=%lld,xfer=%lld,busy=%lld,total=%lld us",
+		  __get_str(name), __entry->cmd, __entry->blocks,
+		  __entry->error, __entry->map_us, __entry->xfer_us,
+		  __entry->busy_us, __entry->total_us)
+);
+
+/*
+ * DMA mapping done by host drivers, either ahead of a request from
+ * pre_req, while the request runs, or the unmap once it is done
+ */
+DECLARE_EVENT_CLASS(mmc_dma_class,
+	TP_PROTO(struct mmc_host *host, struct mmc_data *data, s64 ns),
+	TP_ARGS(host, data, ns),
+	TP_STRUCT__entry(
+		__string(name, mmc_hostname(host))
+		__field(unsigned int, sg_len)
+		__field(unsigned int, size)
+		__field(unsigned int, flags)
+		__field(s64, ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, mmc_hostname(host));
+		__entry->sg_len = data->sg_len;
+		__entry->size = data->blocks * data->blksz;
+		__entry->flags = data->flags;
+		__entry->ns = ns;
+	),
+	TP_printk("%s: sg_len=%u,size=%u,%s,%lld ns",
+		  __get_str(name), __entry->sg_len, __entry->size,
+		  __entry->flags & MMC_DATA_WRITE ? "write" : "read",
+		  __entry->ns)
+);
+
+DEFINE_EVENT(mmc_dma_class, mmc_dma_map_ahead,
+	TP_PROTO(struct mmc_host *host, struct mmc_data *data, s64 ns),
+	TP_ARGS(host, data, ns));
+
+DEFINE_EVENT(mmc_dma_class, mmc_dma_map,
+	TP_PROTO(struct mmc_host *host, struct mmc_data *data, s64 ns),
+	TP_ARGS(host, data, ns));
+
+DEFINE_EVENT(mmc_dma_class, mmc_dma_unmap,
+	TP_PROTO(struct mmc_host *host, struct mmc_data *data, s64 ns),
+	TP_ARGS(host, data, ns));
 #endif /* _TRACE_MMC_H */
 
 /* This part must be outside protection */
@@ -202,6 +202,7 @@ repeat:
 	}
 
 	write_unlock_irq(&tasklist_lock);
+	lowmem_task_del(p);
 	release_thread(p);
 	call_rcu(&p->rcu, delayed_put_task_struct);
 
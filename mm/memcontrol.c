@@ -390,7 +390,6 @@ enum charge_type {
 
 static void mem_cgroup_get(struct mem_cgroup *memcg);
 static void mem_cgroup_put(struct mem_cgroup *memcg);
-static struct mem_cgroup *parent_mem_cgroup(struct mem_cgroup *memcg);
 static void drain_all_stock_async(struct mem_cgroup *memcg);
 
 /* Some nice accessors for the vmpressure. */
@@ -781,7 +780,7 @@ static void memcg_check_events(struct mem_cgroup *memcg, struct page *page)
 		preempt_enable();
 }
 
-static struct mem_cgroup *mem_cgroup_from_cont(struct cgroup *cont)
+struct mem_cgroup *mem_cgroup_from_cont(struct cgroup *cont)
 {
 	return container_of(cgroup_subsys_state(cont,
 				mem_cgroup_subsys_id), struct mem_cgroup,
@@ -1476,6 +1475,7 @@ static unsigned long mem_cgroup_reclaim(struct mem_cgroup *memcg,
 					gfp_t gfp_mask,
 					unsigned long flags)
 {
+	struct vmpressure_stall stall;
 	unsigned long total = 0;
 	bool noswap = false;
 	int loop;
@@ -1485,6 +1485,10 @@ static unsigned long mem_cgroup_reclaim(struct mem_cgroup *memcg,
 	if (!(flags & MEM_CGROUP_RECLAIM_SHRINK) && memcg->memsw_is_minimum)
 		noswap = true;
 
+	/* Limit shrinking by userspace is not a stall of the group */
+	if (!(flags & MEM_CGROUP_RECLAIM_SHRINK))
+		vmpressure_stall_begin(&stall);
+
 	for (loop = 0; loop < MEM_CGROUP_MAX_RECLAIM_LOOPS; loop++) {
 		if (loop)
 			drain_all_stock_async(memcg);
@@ -1505,6 +1509,9 @@ static unsigned long mem_cgroup_reclaim(struct mem_cgroup *memcg,
 		if (loop && !total)
 			break;
 	}
+
+	if (!(flags & MEM_CGROUP_RECLAIM_SHRINK))
+		vmpressure_stall_end(&stall);
 	return total;
 }
 
@@ -4583,6 +4590,14 @@ static int mem_cgroup_oom_control_write(struct cgroup *cgrp,
 	return 0;
 }
 
+static u64 mem_cgroup_stall_window_read(struct cgroup *cgrp,
+					struct cftype *cft)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_cont(cgrp);
+
+	return memcg->vmpressure.stall_window_ms;
+}
+
 #ifdef CONFIG_NUMA
 static const struct file_operations mem_control_numa_stat_file_operations = {
 	.read = seq_read,
@@ -4667,6 +4682,17 @@ static struct cftype mem_cgroup_files[] = {
 		.register_event = vmpressure_register_event,
 		.unregister_event = vmpressure_unregister_event,
 	},
+	{
+		.name = "stall",
+		.read_map = vmpressure_stall_read_map,
+		.register_event = vmpressure_stall_register_event,
+		.unregister_event = vmpressure_stall_unregister_event,
+	},
+	{
+		.name = "stall_window_ms",
+		.read_u64 = mem_cgroup_stall_window_read,
+		.write_u64 = vmpressure_stall_window_write,
+	},
 #ifdef CONFIG_NUMA
 	{
 		.name = "numa_stat",
@@ -4856,7 +4882,7 @@ static void mem_cgroup_put(struct mem_cgroup *memcg)
 /*
  * Returns the parent mem_cgroup in memcgroup hierarchy with hierarchy enabled.
  */
-static struct mem_cgroup *parent_mem_cgroup(struct mem_cgroup *memcg)
+struct mem_cgroup *parent_mem_cgroup(struct mem_cgroup *memcg)
 {
 	if (!memcg->res.parent)
 		return NULL;
@@ -4925,13 +4951,16 @@ mem_cgroup_create(struct cgroup_subsys *ss, struct cgroup *cont)
 		if (alloc_mem_cgroup_per_zone_info(memcg, node))
 			goto free_out;
 
+	if (vmpressure_init(&memcg->vmpressure))
+		goto free_out;
+
 	/* root ? */
 	if (cont->parent == NULL) {
 		int cpu;
 		enable_swap_cgroup();
 		parent = NULL;
 		if (mem_cgroup_soft_limit_tree_init())
-			goto free_out;
+			goto free_vmpressure;
 		root_mem_cgroup = memcg;
 		for_each_possible_cpu(cpu) {
 			struct memcg_stock_pcp *stock =
@@ -4968,8 +4997,9 @@ mem_cgroup_create(struct cgroup_subsys *ss, struct cgroup *cont)
 	memcg->move_charge_at_immigrate = 0;
 	mutex_init(&memcg->thresholds_lock);
 	spin_lock_init(&memcg->move_lock);
-	vmpressure_init(&memcg->vmpressure);
 	return &memcg->css;
+free_vmpressure:
+	vmpressure_cleanup(&memcg->vmpressure);
 free_out:
 	__mem_cgroup_free(memcg);
 	return ERR_PTR(error);
@@ -4988,6 +5018,7 @@ static void mem_cgroup_destroy(struct cgroup_subsys *ss,
 {
 	struct mem_cgroup *memcg = mem_cgroup_from_cont(cont);
 
+	vmpressure_cleanup(&memcg->vmpressure);
 	mem_cgroup_put(memcg);
 }
 
@@ -57,6 +57,7 @@
 #include <linux/swapops.h>
 #include <linux/elf.h>
 #include <linux/gfp.h>
+#include <linux/vmpressure.h>
 
 #include <asm/io.h>
 #include <asm/pgalloc.h>
@@ -2977,6 +2978,7 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	pte_t pte;
 	int locked;
 	struct mem_cgroup *ptr;
+	struct vmpressure_stall stall;
 	int exclusive = 0;
 	int ret = 0;
 
@@ -2996,6 +2998,7 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		goto out;
 	}
 	delayacct_set_flag(DELAYACCT_PF_SWAPIN);
+	vmpressure_stall_begin(&stall);
 	page = lookup_swap_cache(entry);
 	if (!page) {
 		page = swapin_readahead(entry,
@@ -3009,6 +3012,7 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 			if (likely(pte_same(*page_table, orig_pte)))
 				ret = VM_FAULT_OOM;
 			delayacct_clear_flag(DELAYACCT_PF_SWAPIN);
+			vmpressure_stall_end(&stall);
 			goto unlock;
 		}
 
@@ -3023,6 +3027,7 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		 */
 		ret = VM_FAULT_HWPOISON;
 		delayacct_clear_flag(DELAYACCT_PF_SWAPIN);
+		vmpressure_stall_end(&stall);
 		goto out_release;
 	}
 #ifdef CONFIG_ZSWAP
@@ -3033,6 +3038,7 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	locked = lock_page_or_retry(page, mm, flags);
 
 	delayacct_clear_flag(DELAYACCT_PF_SWAPIN);
+	vmpressure_stall_end(&stall);
 	if (!locked) {
 		ret |= VM_FAULT_RETRY;
 		goto out_release;
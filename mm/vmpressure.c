@@ -24,6 +24,10 @@
 #include <linux/slab.h>
 #include <linux/notifier.h>
 #include <linux/init.h>
+#include <linux/ktime.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/memcontrol.h>
 #include <linux/vmpressure.h>
 
 /*
@@ -51,7 +55,29 @@ static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
 static const unsigned int vmpressure_level_med = 60;
 static const unsigned int vmpressure_level_critical = 95;
 
+/*
+ * The scanned/reclaimed ratio tells how hard reclaim works, not what the
+ * tasks pay for it. The stall time does: it is the share of wall time in
+ * which tasks of a group were waiting for memory, either in direct or
+ * memcg limit reclaim or on a page being read back from swap.
+ *
+ * Each cpu accounts the time in which at least one stall that began on it
+ * was running, under a per-cpu lock, so that concurrent stalls on other
+ * cpus do not contend. While stalls are going on, a timer closes the
+ * window every stall_window_ms: it sums the per-cpu times, capped at the
+ * length of the window, and wakes the listeners whose threshold the
+ * percentage reached. Stalls that overlap on different cpus thus add up.
+ * The system wide numbers are in /sys/kernel/mm/vmpressure/, a memcg has
+ * its own in memory.stall.
+ */
+static unsigned int vmpressure_stall_window_ms = 1000;
+static unsigned int vmpressure_stall_threshold = 10;
+
+#define VMPRESSURE_STALL_WINDOW_MIN	10
+#define VMPRESSURE_STALL_WINDOW_MAX	60000
+
 static struct vmpressure global_vmpressure;
+static struct kobject *vmpressure_kobj;
 BLOCKING_NOTIFIER_HEAD(vmpressure_notifier);
 
 int vmpressure_notifier_register(struct notifier_block *nb)
@@ -95,7 +121,7 @@ static struct vmpressure *work_to_vmpressure(struct work_struct *work)
 	return container_of(work, struct vmpressure, work);
 }
 
-#ifdef CONFIG_MEMCG
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
 static struct vmpressure *cg_to_vmpressure(struct cgroup *cg)
 {
 	return css_to_vmpressure(cgroup_subsys_state(cg, mem_cgroup_subsys_id));
@@ -111,6 +137,19 @@ static struct vmpressure *vmpressure_parent(struct vmpressure *vmpr)
 		return NULL;
 	return memcg_to_vmpressure(memcg);
 }
+
+static struct mem_cgroup *vmpressure_stall_memcg(void)
+{
+	if (mem_cgroup_disabled())
+		return NULL;
+	return try_get_mem_cgroup_from_mm(current->mm);
+}
+
+static void vmpressure_stall_put(struct mem_cgroup *memcg)
+{
+	if (memcg)
+		css_put(mem_cgroup_css(memcg));
+}
 #else
 static struct vmpressure *cg_to_vmpressure(struct cgroup *cg)
 {
@@ -121,6 +160,15 @@ static struct vmpressure *vmpressure_parent(struct vmpressure *vmpr)
 {
 	return NULL;
 }
+
+static struct mem_cgroup *vmpressure_stall_memcg(void)
+{
+	return NULL;
+}
+
+static void vmpressure_stall_put(struct mem_cgroup *memcg)
+{
+}
 #endif
 
 enum vmpressure_levels {
@@ -325,10 +373,201 @@ void vmpressure(gfp_t gfp, struct mem_cgroup *memcg,
 	if (!memcg)
 		vmpressure_global(gfp, scanned, reclaimed);
 
-	if (IS_ENABLED(CONFIG_MEMCG))
+	if (IS_ENABLED(CONFIG_CGROUP_MEM_RES_CTLR))
 		vmpressure_memcg(gfp, memcg, scanned, reclaimed);
 }
 
+struct vmpressure_stall_event {
+	struct eventfd_ctx *efd;
+	unsigned int threshold;
+	struct list_head node;
+};
+
+struct vmpressure_stall_cpu {
+	spinlock_t lock;
+	/* stalls begun on this cpu that did not end yet */
+	unsigned int nr;
+	u64 start;
+	/* ns with nr > 0 not folded into the window yet */
+	u64 time;
+};
+
+static u64 vmpressure_clock(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/* Brings @sc up to @now. Called with sc->lock held. */
+static void vmpressure_stall_cpu_account(struct vmpressure_stall_cpu *sc,
+					 u64 now)
+{
+	if (sc->nr)
+		sc->time += now - sc->start;
+	sc->start = now;
+}
+
+static void vmpressure_stall_arm(struct vmpressure *vmpr)
+{
+	spin_lock_bh(&vmpr->stall_lock);
+	if (!timer_pending(&vmpr->stall_timer)) {
+		vmpr->stall_window_start = vmpressure_clock();
+		mod_timer(&vmpr->stall_timer, jiffies +
+			  msecs_to_jiffies(vmpr->stall_window_ms));
+	}
+	spin_unlock_bh(&vmpr->stall_lock);
+}
+
+static void vmpressure_stall_update(struct vmpressure *vmpr, int cpu, int nr)
+{
+	struct vmpressure_stall_cpu *sc;
+
+	/* not set up yet in early boot */
+	if (unlikely(!vmpr->stall_cpu))
+		return;
+
+	sc = per_cpu_ptr(vmpr->stall_cpu, cpu);
+	spin_lock_bh(&sc->lock);
+	vmpressure_stall_cpu_account(sc, vmpressure_clock());
+	sc->nr += nr;
+	spin_unlock_bh(&sc->lock);
+
+	if (nr > 0 && !timer_pending(&vmpr->stall_timer))
+		vmpressure_stall_arm(vmpr);
+}
+
+/*
+ * Closes the window: folds the per-cpu stall times into it and keeps the
+ * timer going for as long as there were stalls in the window.
+ */
+static void vmpressure_stall_timer_fn(unsigned long data)
+{
+	struct vmpressure *vmpr = (struct vmpressure *)data;
+	bool busy = false, done = false;
+	u64 now, elapsed, time = 0;
+	int cpu;
+
+	spin_lock(&vmpr->stall_lock);
+	/* vmpressure_stall_arm() opened a new window meanwhile */
+	if (timer_pending(&vmpr->stall_timer))
+		goto out;
+
+	now = vmpressure_clock();
+	for_each_possible_cpu(cpu) {
+		struct vmpressure_stall_cpu *sc;
+
+		sc = per_cpu_ptr(vmpr->stall_cpu, cpu);
+		spin_lock(&sc->lock);
+		vmpressure_stall_cpu_account(sc, now);
+		if (sc->nr)
+			busy = true;
+		time += sc->time;
+		sc->time = 0;
+		spin_unlock(&sc->lock);
+	}
+
+	elapsed = now - vmpr->stall_window_start;
+	vmpr->stall_total += time;
+	vmpr->stall_pct = elapsed ? min_t(u64, 100,
+					  div64_u64(time * 100, elapsed)) : 0;
+	vmpr->stall_window_start = now;
+	done = vmpr->stall_pct;
+
+	if (busy || time)
+		mod_timer(&vmpr->stall_timer, jiffies +
+			  msecs_to_jiffies(vmpr->stall_window_ms));
+out:
+	spin_unlock(&vmpr->stall_lock);
+
+	if (done)
+		schedule_work(&vmpr->stall_work);
+}
+
+static void vmpressure_stall_read(struct vmpressure *vmpr,
+				  unsigned int *pct, u64 *total)
+{
+	spin_lock_bh(&vmpr->stall_lock);
+	*pct = vmpr->stall_pct;
+	*total = vmpr->stall_total;
+	spin_unlock_bh(&vmpr->stall_lock);
+}
+
+static int vmpressure_stall_set_window(struct vmpressure *vmpr,
+				       unsigned long window_ms)
+{
+	if (window_ms < VMPRESSURE_STALL_WINDOW_MIN ||
+	    window_ms > VMPRESSURE_STALL_WINDOW_MAX)
+		return -EINVAL;
+
+	/* takes effect with the next window */
+	spin_lock_bh(&vmpr->stall_lock);
+	vmpr->stall_window_ms = window_ms;
+	spin_unlock_bh(&vmpr->stall_lock);
+	return 0;
+}
+
+static void vmpressure_stall_work_fn(struct work_struct *work)
+{
+	struct vmpressure *vmpr = container_of(work, struct vmpressure,
+					       stall_work);
+	unsigned int pct = ACCESS_ONCE(vmpr->stall_pct);
+	struct vmpressure_stall_event *ev;
+
+	mutex_lock(&vmpr->events_lock);
+	list_for_each_entry(ev, &vmpr->stall_events, node) {
+		if (pct >= ev->threshold)
+			eventfd_signal(ev->efd, 1);
+	}
+	mutex_unlock(&vmpr->events_lock);
+
+	if (vmpr == &global_vmpressure && vmpressure_kobj &&
+	    pct >= vmpressure_stall_threshold)
+		sysfs_notify(vmpressure_kobj, NULL, "stall");
+}
+
+/**
+ * vmpressure_stall_begin() - Account the start of a memory stall
+ * @stall:	handle to pass to vmpressure_stall_end()
+ *
+ * This function should be called when the current task starts to wait
+ * for memory, i.e. before direct reclaim or a swap-in read. The stall
+ * is charged system wide and to the task's memory cgroup and all of its
+ * parents, on the current cpu. Stalls may nest.
+ */
+void vmpressure_stall_begin(struct vmpressure_stall *stall)
+{
+	struct vmpressure *vmpr;
+
+	stall->cpu = raw_smp_processor_id();
+	vmpressure_stall_update(&global_vmpressure, stall->cpu, 1);
+
+	stall->memcg = vmpressure_stall_memcg();
+	if (stall->memcg) {
+		for (vmpr = memcg_to_vmpressure(stall->memcg); vmpr;
+		     vmpr = vmpressure_parent(vmpr))
+			vmpressure_stall_update(vmpr, stall->cpu, 1);
+	}
+}
+
+/**
+ * vmpressure_stall_end() - Account the end of a memory stall
+ * @stall:	handle filled in by vmpressure_stall_begin()
+ *
+ * The stall ends on the cpu it began on, even if the task moved since.
+ */
+void vmpressure_stall_end(struct vmpressure_stall *stall)
+{
+	struct vmpressure *vmpr;
+
+	vmpressure_stall_update(&global_vmpressure, stall->cpu, -1);
+
+	if (stall->memcg) {
+		for (vmpr = memcg_to_vmpressure(stall->memcg); vmpr;
+		     vmpr = vmpressure_parent(vmpr))
+			vmpressure_stall_update(vmpr, stall->cpu, -1);
+		vmpressure_stall_put(stall->memcg);
+	}
+}
+
 /**
  * vmpressure_prio() - Account memory pressure through reclaimer priority level
  * @gfp:	reclaimer's gfp mask
@@ -441,24 +680,236 @@ void vmpressure_unregister_event(struct cgroup *cg, struct cftype *cft,
 	mutex_unlock(&vmpr->events_lock);
 }
 
+int vmpressure_stall_read_map(struct cgroup *cg, struct cftype *cft,
+			      struct cgroup_map_cb *cb)
+{
+	struct vmpressure *vmpr = cg_to_vmpressure(cg);
+	unsigned int pct;
+	u64 total;
+
+	BUG_ON(!vmpr);
+
+	vmpressure_stall_read(vmpr, &pct, &total);
+	cb->fill(cb, "stall_pct", pct);
+	cb->fill(cb, "stall_total_us", div_u64(total, NSEC_PER_USEC));
+	cb->fill(cb, "window_ms", vmpr->stall_window_ms);
+	return 0;
+}
+
+int vmpressure_stall_window_write(struct cgroup *cg, struct cftype *cft,
+				  u64 val)
+{
+	struct vmpressure *vmpr = cg_to_vmpressure(cg);
+
+	BUG_ON(!vmpr);
+
+	return vmpressure_stall_set_window(vmpr, val);
+}
+
+/**
+ * vmpressure_stall_register_event() - Bind stall notifications to an eventfd
+ * @cg:		cgroup that is interested in stall notifications
+ * @cft:	cgroup control files handle
+ * @eventfd:	eventfd context to link notifications with
+ * @args:	stall percentage threshold, 1 to 100
+ *
+ * The @eventfd is signalled at the end of every window in which the
+ * tasks of @cg stalled for at least @args percent of the time.
+ */
+int vmpressure_stall_register_event(struct cgroup *cg, struct cftype *cft,
+				    struct eventfd_ctx *eventfd,
+				    const char *args)
+{
+	struct vmpressure *vmpr = cg_to_vmpressure(cg);
+	struct vmpressure_stall_event *ev;
+	unsigned int threshold;
+
+	BUG_ON(!vmpr);
+
+	if (kstrtouint(args, 10, &threshold) || !threshold || threshold > 100)
+		return -EINVAL;
+
+	ev = kzalloc(sizeof(*ev), GFP_KERNEL);
+	if (!ev)
+		return -ENOMEM;
+
+	ev->efd = eventfd;
+	ev->threshold = threshold;
+
+	mutex_lock(&vmpr->events_lock);
+	list_add(&ev->node, &vmpr->stall_events);
+	mutex_unlock(&vmpr->events_lock);
+
+	return 0;
+}
+
+void vmpressure_stall_unregister_event(struct cgroup *cg, struct cftype *cft,
+				       struct eventfd_ctx *eventfd)
+{
+	struct vmpressure *vmpr = cg_to_vmpressure(cg);
+	struct vmpressure_stall_event *ev;
+
+	BUG_ON(!vmpr);
+
+	mutex_lock(&vmpr->events_lock);
+	list_for_each_entry(ev, &vmpr->stall_events, node) {
+		if (ev->efd != eventfd)
+			continue;
+		list_del(&ev->node);
+		kfree(ev);
+		break;
+	}
+	mutex_unlock(&vmpr->events_lock);
+}
+
 /**
  * vmpressure_init() - Initialize vmpressure control structure
  * @vmpr:	Structure to be initialized
  *
  * This function should be called on every allocated vmpressure structure
- * before any usage.
+ * before any usage. Returns 0 or -ENOMEM.
  */
-void vmpressure_init(struct vmpressure *vmpr)
+int vmpressure_init(struct vmpressure *vmpr)
 {
+	struct vmpressure_stall_cpu __percpu *stall_cpu;
+	int cpu;
+
+	stall_cpu = alloc_percpu(struct vmpressure_stall_cpu);
+	if (!stall_cpu)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(stall_cpu, cpu)->lock);
+
 	mutex_init(&vmpr->sr_lock);
 	mutex_init(&vmpr->events_lock);
 	INIT_LIST_HEAD(&vmpr->events);
 	INIT_WORK(&vmpr->work, vmpressure_work_fn);
+
+	spin_lock_init(&vmpr->stall_lock);
+	vmpr->stall_window_ms = vmpressure_stall_window_ms;
+	setup_timer(&vmpr->stall_timer, vmpressure_stall_timer_fn,
+		    (unsigned long)vmpr);
+	INIT_LIST_HEAD(&vmpr->stall_events);
+	INIT_WORK(&vmpr->stall_work, vmpressure_stall_work_fn);
+	vmpr->stall_cpu = stall_cpu;
+	return 0;
+}
+
+/**
+ * vmpressure_cleanup() - Shut down vmpressure control structure
+ * @vmpr:	Structure to be cleaned up
+ *
+ * This function should be called before the structure in which it is
+ * embedded is freed, to make sure no timer or notification work is still
+ * pending.
+ */
+void vmpressure_cleanup(struct vmpressure *vmpr)
+{
+	del_timer_sync(&vmpr->stall_timer);
+	flush_work(&vmpr->work);
+	flush_work(&vmpr->stall_work);
+	free_percpu(vmpr->stall_cpu);
+	vmpr->stall_cpu = NULL;
 }
 
+#define VMPRESSURE_ATTR_RO(_name) \
+	static struct kobj_attribute _name##_attr = __ATTR_RO(_name)
+#define VMPRESSURE_ATTR(_name) \
+	static struct kobj_attribute _name##_attr = \
+		__ATTR(_name, 0644, _name##_show, _name##_store)
+
+static ssize_t stall_show(struct kobject *kobj, struct kobj_attribute *attr,
+			  char *buf)
+{
+	unsigned int pct;
+	u64 total;
+
+	vmpressure_stall_read(&global_vmpressure, &pct, &total);
+	return sprintf(buf, "stall_pct %u\nstall_total_us %llu\n", pct,
+		       (unsigned long long)div_u64(total, NSEC_PER_USEC));
+}
+VMPRESSURE_ATTR_RO(stall);
+
+static ssize_t stall_window_ms_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", global_vmpressure.stall_window_ms);
+}
+
+static ssize_t stall_window_ms_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	unsigned long window_ms;
+	int err;
+
+	err = kstrtoul(buf, 10, &window_ms);
+	if (err)
+		return err;
+
+	err = vmpressure_stall_set_window(&global_vmpressure, window_ms);
+	if (err)
+		return err;
+	return count;
+}
+VMPRESSURE_ATTR(stall_window_ms);
+
+static ssize_t stall_threshold_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", vmpressure_stall_threshold);
+}
+
+static ssize_t stall_threshold_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	unsigned int threshold;
+	int err;
+
+	err = kstrtouint(buf, 10, &threshold);
+	if (err)
+		return err;
+	if (!threshold || threshold > 100)
+		return -EINVAL;
+
+	vmpressure_stall_threshold = threshold;
+	return count;
+}
+VMPRESSURE_ATTR(stall_threshold);
+
+static struct attribute *vmpressure_attrs[] = {
+	&stall_attr.attr,
+	&stall_window_ms_attr.attr,
+	&stall_threshold_attr.attr,
+	NULL,
+};
+
+static struct attribute_group vmpressure_attr_group = {
+	.attrs = vmpressure_attrs,
+};
+
 int vmpressure_global_init(void)
 {
-	vmpressure_init(&global_vmpressure);
+	return vmpressure_init(&global_vmpressure);
+}
+core_initcall(vmpressure_global_init);
+
+static int __init vmpressure_sysfs_init(void)
+{
+	struct kobject *kobj;
+	int err;
+
+	kobj = kobject_create_and_add("vmpressure", mm_kobj);
+	if (!kobj)
+		return -ENOMEM;
+
+	err = sysfs_create_group(kobj, &vmpressure_attr_group);
+	if (err) {
+		kobject_put(kobj);
+		return err;
+	}
+	vmpressure_kobj = kobj;
 	return 0;
 }
-late_initcall(vmpressure_global_init);
+late_initcall(vmpressure_sysfs_init);
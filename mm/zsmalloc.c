@@ -68,6 +68,7 @@
 #include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/debugfs.h>
+#include <linux/workqueue.h>
 #include <linux/zsmalloc.h>
 #include <linux/zpool.h>
 
@@ -175,14 +176,12 @@ enum zs_stat_type {
 	NR_ZS_STAT_TYPE,
 };
 
-#ifdef CONFIG_ZSMALLOC_STAT
-
-static struct dentry *zs_stat_root;
-
 struct zs_size_stat {
 	unsigned long objs[NR_ZS_STAT_TYPE];
 };
 
+#ifdef CONFIG_ZSMALLOC_STAT
+static struct dentry *zs_stat_root;
 #endif
 
 /*
@@ -219,9 +218,7 @@ struct size_class {
 	/* huge object: pages_per_zspage == 1 && maxobj_per_zspage == 1 */
 	bool huge;
 
-#ifdef CONFIG_ZSMALLOC_STAT
 	struct zs_size_stat stats;
-#endif
 
 	spinlock_t lock;
 
@@ -257,6 +254,19 @@ struct zs_pool {
 	gfp_t flags;	/* allocation flags used when growing pool */
 	atomic_long_t pages_allocated;
 
+	/* Compact classes under memory pressure */
+	struct shrinker shrinker;
+	bool shrinker_enabled;
+	/*
+	 * Compact in the background once this percentage of the pool
+	 * could be freed by compaction, 0 disables it.
+	 */
+	unsigned int compact_threshold;
+	unsigned long next_frag_check;
+	struct work_struct compact_work;
+	atomic_long_t pages_compacted;
+	atomic_long_t auto_compactions;
+
 #ifdef CONFIG_ZSMALLOC_STAT
 	struct dentry *stat_dentry;
 #endif
@@ -294,10 +304,10 @@ static void destroy_handle_cache(struct zs_pool *pool)
 	kmem_cache_destroy(pool->handle_cachep);
 }
 
-static unsigned long alloc_handle(struct zs_pool *pool)
+static unsigned long alloc_handle(struct zs_pool *pool, gfp_t gfp)
 {
 	return (unsigned long)kmem_cache_alloc(pool->handle_cachep,
-		pool->flags & ~__GFP_HIGHMEM);
+		gfp & ~__GFP_HIGHMEM);
 }
 
 static void free_handle(struct zs_pool *pool, unsigned long handle)
@@ -327,7 +337,7 @@ static void zs_zpool_destroy(void *pool)
 static int zs_zpool_malloc(void *pool, size_t size, gfp_t gfp,
 			unsigned long *handle)
 {
-	*handle = zs_malloc(pool, size);
+	*handle = zs_malloc(pool, size, gfp);
 	return *handle ? 0 : -1;
 }
 static void zs_zpool_free(void *pool, unsigned long handle)
@@ -445,8 +455,6 @@ static int get_size_class_index(int size)
 	return min(zs_size_classes - 1, idx);
 }
 
-#ifdef CONFIG_ZSMALLOC_STAT
-
 static inline void zs_stat_inc(struct size_class *class,
 				enum zs_stat_type type, unsigned long cnt)
 {
@@ -465,6 +473,8 @@ static inline unsigned long zs_stat_get(struct size_class *class,
 	return class->stats.objs[type];
 }
 
+#ifdef CONFIG_ZSMALLOC_STAT
+
 static int __init zs_stat_init(void)
 {
 	if (!debugfs_initialized())
@@ -581,22 +591,6 @@ static void zs_pool_stat_destroy(struct zs_pool *pool)
 
 #else /* CONFIG_ZSMALLOC_STAT */
 
-static inline void zs_stat_inc(struct size_class *class,
-				enum zs_stat_type type, unsigned long cnt)
-{
-}
-
-static inline void zs_stat_dec(struct size_class *class,
-				enum zs_stat_type type, unsigned long cnt)
-{
-}
-
-static inline unsigned long zs_stat_get(struct size_class *class,
-				enum zs_stat_type type)
-{
-	return 0;
-}
-
 static int __init zs_stat_init(void)
 {
 	return 0;
@@ -1379,12 +1373,13 @@ static unsigned long obj_malloc(struct page *first_page,
  * zs_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
  * @size: size of block to allocate
+ * @gfp: gfp flags when allocating object
  *
  * On success, handle to the allocated object is returned,
  * otherwise 0.
  * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
  */
-unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t gfp)
 {
 	unsigned long handle, obj;
 	struct size_class *class;
@@ -1393,7 +1388,7 @@ unsigned long zs_malloc(struct zs_pool *pool, size_t size)
 	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
 		return 0;
 
-	handle = alloc_handle(pool);
+	handle = alloc_handle(pool, gfp);
 	if (!handle)
 		return 0;
 
@@ -1406,7 +1401,7 @@ unsigned long zs_malloc(struct zs_pool *pool, size_t size)
 
 	if (!first_page) {
 		spin_unlock(&class->lock);
-		first_page = alloc_zspage(class, pool->flags);
+		first_page = alloc_zspage(class, gfp);
 		if (unlikely(!first_page)) {
 			free_handle(pool, handle);
 			return 0;
@@ -1463,6 +1458,65 @@ static void obj_free(struct zs_pool *pool, struct size_class *class,
 	zs_stat_dec(class, OBJ_USED, 1);
 }
 
+/*
+ * Number of pages compaction could free in this class: the unused
+ * object slots, rounded down to whole zspages.
+ */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_wasted;
+	unsigned long obj_allocated = zs_stat_get(class, OBJ_ALLOCATED);
+	unsigned long obj_used = zs_stat_get(class, OBJ_USED);
+
+	if (obj_allocated <= obj_used)
+		return 0;
+
+	obj_wasted = obj_allocated - obj_used;
+	obj_wasted /= get_maxobj_per_zspage(class->size,
+			class->pages_per_zspage);
+
+	return obj_wasted * class->pages_per_zspage;
+}
+
+static unsigned long zs_pages_compactable(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+	struct size_class *class;
+
+	for (i = zs_size_classes - 1; i >= 0; i--) {
+		class = pool->size_class[i];
+		if (!class)
+			continue;
+		if (class->index != i)
+			continue;
+		pages += zs_can_compact(class);
+	}
+
+	return pages;
+}
+
+/*
+ * Called when a zspage becomes ALMOST_EMPTY. Walking all classes is
+ * not free, so the pool is looked at no more than every
+ * ZS_FRAG_CHECK_INTERVAL.
+ */
+#define ZS_FRAG_CHECK_INTERVAL	HZ
+
+static void zs_check_fragmentation(struct zs_pool *pool)
+{
+	unsigned int threshold = pool->compact_threshold;
+	unsigned long wasted;
+
+	if (!threshold || time_before(jiffies, pool->next_frag_check))
+		return;
+
+	pool->next_frag_check = jiffies + ZS_FRAG_CHECK_INTERVAL;
+	wasted = zs_pages_compactable(pool);
+	if (wasted && wasted * 100 >= zs_get_total_pages(pool) * threshold)
+		schedule_work(&pool->compact_work);
+}
+
 void zs_free(struct zs_pool *pool, unsigned long handle)
 {
 	struct page *first_page, *f_page;
@@ -1496,6 +1550,9 @@ void zs_free(struct zs_pool *pool, unsigned long handle)
 	unpin_tag(handle);
 
 	free_handle(pool, handle);
+
+	if (fullness == ZS_ALMOST_EMPTY)
+		zs_check_fragmentation(pool);
 }
 EXPORT_SYMBOL_GPL(zs_free);
 
@@ -1672,7 +1729,8 @@ static struct page *alloc_target_page(struct size_class *class)
 	return page;
 }
 
-static void putback_zspage(struct zs_pool *pool, struct size_class *class,
+/* Returns true if the zspage was empty and has been freed */
+static bool putback_zspage(struct zs_pool *pool, struct size_class *class,
 				struct page *first_page)
 {
 	enum fullness_group fullness;
@@ -1688,9 +1746,13 @@ static void putback_zspage(struct zs_pool *pool, struct size_class *class,
 			class->size, class->pages_per_zspage));
 		atomic_long_sub(class->pages_per_zspage,
 				&pool->pages_allocated);
+		atomic_long_add(class->pages_per_zspage,
+				&pool->pages_compacted);
 
 		free_zspage(first_page);
+		return true;
 	}
+	return false;
 }
 
 static struct page *isolate_source_page(struct size_class *class)
@@ -1704,8 +1766,13 @@ static struct page *isolate_source_page(struct size_class *class)
 	return page;
 }
 
+/*
+ * Compact @class until it could not free another zspage or *@nr_pages
+ * pages have been freed. *@nr_pages is reduced by the pages freed.
+ */
 static unsigned long __zs_compact(struct zs_pool *pool,
-				struct size_class *class)
+				struct size_class *class,
+				unsigned long *nr_pages)
 {
 	int nr_to_migrate;
 	struct zs_compact_control cc;
@@ -1718,6 +1785,10 @@ static unsigned long __zs_compact(struct zs_pool *pool,
 
 		BUG_ON(!is_first_page(src_page));
 
+		/* Leave the rest, they would not free a whole zspage */
+		if (!zs_can_compact(class))
+			break;
+
 		/* The goal is to migrate all live objects in source page */
 		nr_to_migrate = src_page->inuse;
 		cc.index = 0;
@@ -1742,11 +1813,16 @@ static unsigned long __zs_compact(struct zs_pool *pool,
 			break;
 
 		putback_zspage(pool, class, dst_page);
-		putback_zspage(pool, class, src_page);
+		if (putback_zspage(pool, class, src_page))
+			*nr_pages -= min_t(unsigned long, *nr_pages,
+					   class->pages_per_zspage);
+		src_page = NULL;
 		spin_unlock(&class->lock);
 		nr_total_migrated += cc.nr_migrated;
 		cond_resched();
 		spin_lock(&class->lock);
+		if (!*nr_pages)
+			break;
 	}
 
 	if (src_page)
@@ -1757,25 +1833,94 @@ static unsigned long __zs_compact(struct zs_pool *pool,
 	return nr_total_migrated;
 }
 
-unsigned long zs_compact(struct zs_pool *pool)
+static unsigned long zs_compact_pages(struct zs_pool *pool,
+				unsigned long nr_pages)
 {
 	int i;
 	unsigned long nr_migrated = 0;
 	struct size_class *class;
 
-	for (i = zs_size_classes - 1; i >= 0; i--) {
+	for (i = zs_size_classes - 1; i >= 0 && nr_pages; i--) {
 		class = pool->size_class[i];
 		if (!class)
 			continue;
 		if (class->index != i)
 			continue;
-		nr_migrated += __zs_compact(pool, class);
+		nr_migrated += __zs_compact(pool, class, &nr_pages);
 	}
 
 	return nr_migrated;
 }
+
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	return zs_compact_pages(pool, ULONG_MAX);
+}
 EXPORT_SYMBOL_GPL(zs_compact);
 
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+	stats->auto_compactions = atomic_long_read(&pool->auto_compactions);
+}
+EXPORT_SYMBOL_GPL(zs_pool_stats);
+
+/**
+ * zs_set_compact_threshold - Compact in the background on fragmentation
+ * @pool: pool to configure
+ * @percent: share of the pool compaction could free, 0 disables
+ *
+ * Once at least @percent of the pages used by @pool are held by unused
+ * object slots in ALMOST_EMPTY zspages, zs_free() schedules compaction.
+ */
+void zs_set_compact_threshold(struct zs_pool *pool, unsigned int percent)
+{
+	pool->compact_threshold = min(percent, 100U);
+}
+EXPORT_SYMBOL_GPL(zs_set_compact_threshold);
+
+static void zs_compact_work(struct work_struct *work)
+{
+	struct zs_pool *pool = container_of(work, struct zs_pool,
+						compact_work);
+
+	atomic_long_inc(&pool->auto_compactions);
+	zs_compact(pool);
+}
+
+static int zs_shrinker_shrink(struct shrinker *shrinker,
+				struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+						shrinker);
+	unsigned long pages;
+
+	/* free about as many pages as the VM asked to scan */
+	if (sc->nr_to_scan) {
+		atomic_long_inc(&pool->auto_compactions);
+		zs_compact_pages(pool, sc->nr_to_scan);
+	}
+
+	pages = zs_pages_compactable(pool);
+	return min_t(unsigned long, pages, INT_MAX);
+}
+
+static void zs_register_shrinker(struct zs_pool *pool)
+{
+	pool->shrinker.shrink = zs_shrinker_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+	pool->shrinker_enabled = true;
+}
+
+static void zs_unregister_shrinker(struct zs_pool *pool)
+{
+	if (pool->shrinker_enabled) {
+		unregister_shrinker(&pool->shrinker);
+		pool->shrinker_enabled = false;
+	}
+}
+
 /**
  * zs_create_pool - Creates an allocation pool to work from.
  * @flags: allocation flags used to allocate pool metadata
@@ -1796,6 +1941,7 @@ struct zs_pool *zs_create_pool(char *name, gfp_t flags)
 	if (!pool)
 		return NULL;
 
+	INIT_WORK(&pool->compact_work, zs_compact_work);
 	pool->size_class = kcalloc(zs_size_classes, sizeof(struct size_class *),
 			GFP_KERNEL);
 	if (!pool->size_class) {
@@ -1861,6 +2007,8 @@ struct zs_pool *zs_create_pool(char *name, gfp_t flags)
 	if (zs_pool_stat_create(name, pool))
 		goto err;
 
+	zs_register_shrinker(pool);
+
 	return pool;
 
 err:
@@ -1873,6 +2021,8 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	zs_unregister_shrinker(pool);
+	cancel_work_sync(&pool->compact_work);
 	zs_pool_stat_destroy(pool);
 
 	for (i = 0; i < zs_size_classes; i++) {
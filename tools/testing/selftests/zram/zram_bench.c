@@ -0,0 +1,155 @@
+/*
+ * Parallel write microbenchmark for zram compression streams.
+ *
+ * Starts a number of threads, each writing pages of semi-compressible
+ * data with O_DIRECT to its own region of the given block device, and
+ * reports throughput and write latency percentiles.
+ *
+ * usage: zram_bench <device> <threads> <pages per thread>
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGE_SZ		4096
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	int id;
+	long pages;
+	unsigned long *lat;	/* per write latency in ns */
+	int err;
+};
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Half random, half repeated bytes: compresses to roughly 50% */
+static void fill_page(unsigned char *buf, unsigned int *seed)
+{
+	int i;
+
+	for (i = 0; i < PAGE_SZ / 2; i++)
+		buf[i] = rand_r(seed);
+	memset(buf + PAGE_SZ / 2, buf[0], PAGE_SZ / 2);
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int seed = w->id + 1;
+	unsigned char *buf;
+	unsigned long start;
+	off_t off;
+	long i;
+
+	if (posix_memalign((void **)&buf, PAGE_SZ, PAGE_SZ)) {
+		w->err = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < w->pages; i++) {
+		fill_page(buf, &seed);
+		off = ((off_t)w->id * w->pages + i) * PAGE_SZ;
+		start = now_ns();
+		if (pwrite(w->fd, buf, PAGE_SZ, off) != PAGE_SZ) {
+			w->err = errno;
+			break;
+		}
+		w->lat[i] = now_ns() - start;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	unsigned long *lat, start, elapsed;
+	long pages, total;
+	int nr, fd, i;
+
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s <device> <threads> <pages>\n",
+			argv[0]);
+		return 1;
+	}
+
+	nr = atoi(argv[2]);
+	pages = atol(argv[3]);
+	if (nr <= 0 || pages <= 0) {
+		fprintf(stderr, "invalid thread or page count\n");
+		return 1;
+	}
+
+	fd = open(argv[1], O_WRONLY | O_DIRECT);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	total = nr * pages;
+	workers = calloc(nr, sizeof(*workers));
+	lat = calloc(total, sizeof(*lat));
+	if (!workers || !lat) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < nr; i++) {
+		workers[i].fd = fd;
+		workers[i].id = i;
+		workers[i].pages = pages;
+		workers[i].lat = lat + i * pages;
+		if (pthread_create(&workers[i].thread, NULL, worker_fn,
+				   &workers[i])) {
+			fprintf(stderr, "cannot create thread %d\n", i);
+			return 1;
+		}
+	}
+	for (i = 0; i < nr; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < nr; i++) {
+		if (workers[i].err) {
+			fprintf(stderr, "thread %d: %s\n", i,
+				strerror(workers[i].err));
+			return 1;
+		}
+	}
+
+	qsort(lat, total, sizeof(*lat), cmp_ulong);
+	printf("threads %d pages %ld: %lu MB/s, latency us p50 %lu p99 %lu max %lu\n",
+	       nr, total,
+	       (unsigned long)(total * PAGE_SZ / (elapsed / 1000 + 1)),
+	       lat[total / 2] / 1000, lat[total * 99 / 100] / 1000,
+	       lat[total - 1] / 1000);
+
+	free(lat);
+	free(workers);
+	close(fd);
+	return 0;
+}